@@ -0,0 +1,976 @@
+#include "aot.h"
+#include "cfg.h"
+#include "cpu.h"
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+// Run-time support of a translated program, after its constants: guest
+// state, output, stack, system calls and the fallback interpreter, which
+// follows VM::run_switch() instruction for instruction
+static const char *const runtime = R"(
+static uint8_t memory[0x10000]; // 16-bit accesses at 0xFFFF wrap to 0
+static bool code_byte[0x10000];   // covered by the translation
+static bool block_start[0x10000]; // has a label in run()
+static uint16_t pc = START, sp = STACK_TOP, a, b, c;
+static uint16_t v[4][8]; // vector registers
+static bool zero_flag, negative_flag;
+static bool running = true;
+static bool patched; // translated code was written to: interpret from now on
+
+static char out_buf[16384];
+static size_t out_len;
+
+static void flush_out()
+{
+    size_t done = 0;
+    while (done < out_len)
+    {
+        ssize_t n = write(STDOUT_FILENO, out_buf + done, out_len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    out_len = 0;
+}
+
+static void put_char(char ch)
+{
+    if (out_len == sizeof(out_buf))
+        flush_out();
+    out_buf[out_len++] = ch;
+}
+
+static void put_dec(uint16_t value)
+{
+    char digits[5];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n)
+        put_char(digits[--n]);
+}
+
+// `len` bytes at `addr`, wrapping past 0xFFFF
+static void put_bytes(uint16_t addr, uint16_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+        put_char(memory[(uint16_t)(addr + i)]);
+}
+
+static void put_string(uint16_t addr)
+{
+    for (uint32_t i = 0; i < 0x10000 && memory[(uint16_t)(addr + i)]; i++)
+        put_char(memory[(uint16_t)(addr + i)]);
+}
+
+// Stop with an error on stderr, after the output so far
+static void fault(const char *format, ...)
+{
+    flush_out();
+    running = false;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+static void stack_fault(bool overflow, uint16_t at)
+{
+    fault("Stack %s at PC: %u\n", overflow ? "overflow" : "underflow", at);
+}
+
+static void store8(uint16_t addr, uint8_t value)
+{
+    memory[addr] = value;
+    if (code_byte[addr])
+        patched = true;
+}
+
+// A block store of `len` bytes at `addr`, wrapping past 0xFFFF
+static void stored(uint16_t addr, uint16_t len)
+{
+    uint32_t head = len < 0x10000 - addr ? len : 0x10000 - addr;
+    if (memchr(code_byte + addr, true, head) || memchr(code_byte, true, len - head))
+        patched = true;
+}
+
+static void block_copy(uint16_t dst, uint16_t src, uint16_t len)
+{
+    static uint8_t staged[0x10000];
+    if (len == 0 || dst == src)
+        return;
+    if (dst + len <= 0x10000 && src + len <= 0x10000)
+        memmove(memory + dst, memory + src, len);
+    else
+    {
+        uint32_t head = len < 0x10000 - src ? len : 0x10000 - src;
+        memcpy(staged, memory + src, head);
+        memcpy(staged + head, memory, len - head);
+        head = len < 0x10000 - dst ? len : 0x10000 - dst;
+        memcpy(memory + dst, staged, head);
+        memcpy(memory, staged + head, len - head);
+    }
+    stored(dst, len);
+}
+
+static void block_fill(uint16_t dst, uint8_t value, uint16_t len)
+{
+    uint32_t head = len < 0x10000 - dst ? len : 0x10000 - dst;
+    memset(memory + dst, value, head);
+    memset(memory, value, len - head);
+    stored(dst, len);
+}
+
+static void block_compare(uint16_t x, uint16_t y, uint16_t len)
+{
+    int order = 0;
+    while (len && !order)
+    {
+        uint32_t run = len;
+        if (run > 0x10000u - x)
+            run = 0x10000u - x;
+        if (run > 0x10000u - y)
+            run = 0x10000u - y;
+        order = memcmp(memory + x, memory + y, run);
+        x += run;
+        y += run;
+        len -= run;
+    }
+    zero_flag = (order == 0);
+    negative_flag = (order < 0);
+}
+
+// Up to `len` bytes of stdin to `addr`; a line stops after its newline
+static uint16_t read_input(uint16_t addr, uint16_t len, bool line)
+{
+    flush_out();
+    uint16_t count = 0;
+    while (count < len)
+    {
+        int ch = getchar();
+        if (ch == EOF)
+            break;
+        memory[(uint16_t)(addr + count++)] = ch;
+        if (line && ch == '\n')
+            break;
+    }
+    stored(addr, count);
+    return count;
+}
+
+// Vector instruction `opcode` on registers x and, for pairs, y
+static void vector_op(uint8_t opcode, uint8_t x, uint8_t y)
+{
+    uint16_t *p = v[x], *q = v[y];
+    uint16_t result = p[0];
+    for (int i = 0; i < 8; i++)
+    {
+        switch (opcode)
+        {
+        case VLOAD:
+            p[i] = memory[(uint16_t)(b + 2 * i)] | (memory[(uint16_t)(b + 2 * i + 1)] << 8);
+            break;
+        case VSTORE:
+            store8((uint16_t)(b + 2 * i), p[i] & 0xFF);
+            store8((uint16_t)(b + 2 * i + 1), p[i] >> 8);
+            break;
+        case VSPLAT:
+            p[i] = a;
+            break;
+        case VADD:
+            p[i] += q[i];
+            break;
+        case VSUB:
+            p[i] -= q[i];
+            break;
+        case VAND:
+            p[i] &= q[i];
+            break;
+        case VOR:
+            p[i] |= q[i];
+            break;
+        case VXOR:
+            p[i] ^= q[i];
+            break;
+        case VCMPEQ:
+            p[i] = p[i] == q[i] ? 0xFFFF : 0;
+            break;
+        case VCMPGT:
+            p[i] = p[i] > q[i] ? 0xFFFF : 0;
+            break;
+        case VSUM:
+            result = i ? result + p[i] : p[0];
+            break;
+        case VMIN:
+            result = p[i] < result ? p[i] : result;
+            break;
+        case VMAX:
+            result = p[i] > result ? p[i] : result;
+            break;
+        }
+    }
+    if (opcode == VSUM || opcode == VMIN || opcode == VMAX)
+        a = result;
+}
+
+static bool push(uint16_t value)
+{
+    if (sp < STACK_LIMIT)
+        return false;
+    sp -= 2;
+    store8(sp, value & 0xFF);
+    store8(sp + 1, value >> 8);
+    return true;
+}
+
+static bool pop(uint16_t &value)
+{
+    if (sp + 2 > STACK_TOP)
+        return false;
+    value = memory[sp] | (memory[sp + 1] << 8);
+    sp += 2;
+    return true;
+}
+
+static void guest_wait(uint16_t units)
+{
+    if (REALTIME)
+    {
+        flush_out();
+        std::this_thread::sleep_for(std::chrono::milliseconds(units));
+    }
+}
+
+static void reset()
+{
+    pc = ENTRY;
+    sp = STACK_TOP;
+    a = 0;
+    b = 0;
+    zero_flag = false;
+    negative_flag = false;
+}
+
+static void guest_syscall()
+{
+    switch (a)
+    {
+    case 0x00:
+        break;
+    case 0x01:
+        guest_wait(b);
+        break;
+    case 0x02:
+        put_dec(b);
+        put_char('\n');
+        break;
+    case 0x03:
+        put_char(b & 0xFF);
+        break;
+    case 0x04:
+        put_bytes(b, c);
+        break;
+    case 0x05:
+        put_string(b);
+        break;
+    case 0x06:
+    case 0x07:
+        a = read_input(b, c, a == 0x06);
+        break;
+    case 0xFF:
+        running = false;
+        break;
+    default:
+        fault("Unknown syscall: %u\n", a);
+        break;
+    }
+}
+
+// Returns true if it restarted the program
+static bool interrupt(uint8_t number)
+{
+    switch (number)
+    {
+    case 0x10:
+        put_char(b & 0xFF);
+        break;
+    case 0x11:
+        put_dec(b);
+        put_char('\n');
+        break;
+    case 0x12:
+        guest_wait(b);
+        break;
+    case 0x13:
+        reset();
+        return true;
+    default:
+        fault("Unhandled INT %x\n", number);
+        break;
+    }
+    return false;
+}
+
+static uint8_t fetch8()
+{
+    return memory[pc++];
+}
+
+static uint16_t fetch16()
+{
+    uint16_t high = fetch8();
+    return (high << 8) | fetch8();
+}
+
+static void store16(uint16_t addr, uint16_t value)
+{
+    store8(addr, value & 0xFF);
+    store8((uint16_t)(addr + 1), value >> 8);
+}
+
+// Banks out of the window live here, allocated on the first switch. The
+// window holds the mapped bank's bytes; a switch swaps them.
+static uint8_t *banks;
+static uint16_t bank;
+
+static void select_bank(uint16_t number)
+{
+    if (number >= BANKS)
+    {
+        fault("Bank out of range: %u\n", number);
+        return;
+    }
+    if (number == bank)
+        return;
+    if (!banks && !(banks = (uint8_t *)calloc(BANKS, BANK_SIZE)))
+    {
+        fault("Out of memory for %u banks\n", BANKS);
+        return;
+    }
+    memcpy(banks + (size_t)bank * BANK_SIZE, memory + BANK_WINDOW, BANK_SIZE);
+    memcpy(memory + BANK_WINDOW, banks + (size_t)number * BANK_SIZE, BANK_SIZE);
+    bank = number;
+    if (memchr(code_byte + BANK_WINDOW, true, BANK_SIZE))
+        patched = true;
+}
+
+// Interpret until the guest stops or, while the translation is still
+// good, reaches the start of a translated block
+static void interpret()
+{
+    uint16_t addr, value;
+    uint8_t reg;
+    while (running && (patched || !block_start[pc]))
+    {
+        uint16_t at = pc;
+        uint8_t opcode = fetch8();
+        switch (opcode)
+        {
+        case NOP:
+            break;
+        case INC:
+            reg = fetch8();
+            if (reg == 'a')
+                ++a;
+            else if (reg == 'b')
+                ++b;
+            else if (reg == 'c')
+                ++c;
+            break;
+        case LDA_IMM:
+            a = fetch16();
+            break;
+        case LDB_IMM:
+            b = fetch16();
+            break;
+        case LDC_IMM:
+            c = fetch16();
+            break;
+        case ADD:
+            a += b;
+            break;
+        case SUB:
+            a -= b;
+            break;
+        case MUL:
+            a *= b;
+            break;
+        case DIV:
+            if (b != 0)
+                a /= b;
+            break;
+        case MOD:
+            if (b != 0)
+                a %= b;
+            break;
+        case PRINT_A:
+            put_dec(a);
+            break;
+        case PRINT_R:
+            reg = fetch8();
+            if (reg == 'a')
+                put_dec(a);
+            else if (reg == 'b')
+                put_dec(b);
+            else if (reg == 'c')
+                put_dec(c);
+            else
+                fault("Unknown register: %c\n", reg);
+            break;
+        case PRINT_CHAR:
+            put_char(a & 0xFF);
+            break;
+        case IN_A:
+            flush_out();
+            a = getchar();
+            break;
+        case JMP:
+            pc = fetch16();
+            break;
+        case JZ:
+            addr = fetch16();
+            if (zero_flag)
+                pc = addr;
+            break;
+        case JNZ:
+            addr = fetch16();
+            if (!zero_flag)
+                pc = addr;
+            break;
+        case JN:
+            addr = fetch16();
+            if (negative_flag)
+                pc = addr;
+            break;
+        case JP:
+            addr = fetch16();
+            if (!negative_flag && !zero_flag)
+                pc = addr;
+            break;
+        case JEQ:
+            addr = fetch16();
+            if (b == c)
+                pc = addr;
+            break;
+        case JGT:
+            addr = fetch16();
+            if (b > c)
+                pc = addr;
+            break;
+        case JLT:
+            addr = fetch16();
+            if (b < c)
+                pc = addr;
+            break;
+        case CMP:
+            zero_flag = (c == b);
+            negative_flag = (b < c);
+            break;
+        case HLT:
+        case HALT:
+            running = false;
+            break;
+        case LOAD_A_MEM:
+            addr = fetch16();
+            a = (memory[addr] << 8) | memory[(uint16_t)(addr + 1)];
+            break;
+        case STORE_A_MEM:
+            addr = fetch16();
+            store16(addr, a);
+            break;
+        case LOAD8_A_MEM:
+            addr = fetch16();
+            a = memory[addr];
+            break;
+        case STORE8_A_MEM:
+            addr = fetch16();
+            store8(addr, a & 0xFF);
+            break;
+        case MOV_MEM_IMM:
+            addr = fetch16();
+            value = fetch16();
+            store8(addr, value >> 8);
+            store8((uint16_t)(addr + 1), value & 0xFF);
+            break;
+        case MOV8_MEM_IMM:
+            addr = fetch16();
+            store8(addr, fetch8());
+            break;
+        case MOV_REG_IMM:
+            reg = fetch8();
+            fetch16();
+            value = fetch16();
+            if (reg == 'a')
+                a = value;
+            else if (reg == 'b')
+                b = value;
+            break;
+        case MOV_REG_REG:
+            reg = fetch8();
+            fetch8();
+            if (reg == 'a')
+                a = b;
+            else
+                b = a;
+            break;
+        case MOV_MEM_REG:
+        case STORE:
+            addr = fetch16();
+            reg = fetch8();
+            if (reg == 'a')
+                store16(addr, a);
+            else if (reg == 'b')
+                store16(addr, b);
+            break;
+        case MOV_REG_MEM2:
+            reg = fetch8();
+            addr = fetch16();
+            if (reg == 'a')
+                a = memory[addr] | (memory[(uint16_t)(addr + 1)] << 8);
+            else if (reg == 'b')
+                b = memory[addr] | (memory[(uint16_t)(addr + 1)] << 8);
+            break;
+        case MOV_REG_MEM:
+        case LOAD:
+            reg = fetch8();
+            addr = fetch16();
+            if (reg == 'a')
+                a = memory[addr];
+            else if (reg == 'b')
+                b = memory[addr];
+            break;
+        case MEMCPY:
+            block_copy(a, b, c);
+            break;
+        case MEMSET:
+            block_fill(a, b & 0xFF, c);
+            break;
+        case MEMCMP:
+            block_compare(a, b, c);
+            break;
+        case BANK:
+            select_bank(a);
+            break;
+        case VADD:
+        case VSUB:
+        case VAND:
+        case VOR:
+        case VXOR:
+        case VCMPEQ:
+        case VCMPGT:
+            addr = fetch8();
+            reg = fetch8();
+            if (addr < 4 && reg < 4)
+                vector_op(opcode, addr, reg);
+            break;
+        case VLOAD:
+        case VSTORE:
+        case VSPLAT:
+        case VSUM:
+        case VMIN:
+        case VMAX:
+            reg = fetch8();
+            if (reg < 4)
+                vector_op(opcode, reg, 0);
+            break;
+        case CALL:
+            addr = fetch16();
+            if (push(pc))
+                pc = addr;
+            else
+                stack_fault(true, at);
+            break;
+        case RET:
+            if (pop(addr))
+                pc = addr;
+            else
+                stack_fault(false, at);
+            break;
+        case PUSH_A:
+            if (!push(a))
+                stack_fault(true, at);
+            break;
+        case POP_A:
+            if (!pop(a))
+                stack_fault(false, at);
+            break;
+        case PUSH_B:
+            if (!push(b))
+                stack_fault(true, at);
+            break;
+        case POP_B:
+            if (!pop(b))
+                stack_fault(false, at);
+            break;
+        case AND:
+            a &= b;
+            break;
+        case OR:
+            a |= b;
+            break;
+        case XOR:
+            a ^= b;
+            break;
+        case NOT:
+            a = ~a;
+            break;
+        case SHL:
+            a <<= 1;
+            break;
+        case SHR:
+            a >>= 1;
+            break;
+        case WAIT:
+            guest_wait(fetch8());
+            break;
+        case SYSCALL:
+            guest_syscall();
+            break;
+        case INT:
+            interrupt(fetch8());
+            break;
+        case RESET:
+            reset();
+            break;
+        default:
+            fault("Unknown opcode: %d at PC: %u\n", opcode, at);
+            break;
+        }
+    }
+}
+)";
+
+static std::string hex4(uint32_t value)
+{
+    std::ostringstream s;
+    s << "0x" << std::hex << std::setw(4) << std::setfill('0') << value;
+    return s.str();
+}
+
+static std::string label(uint16_t addr)
+{
+    return "b_" + hex4(addr).substr(2);
+}
+
+// Control to `target`: straight to its block when it has one
+static std::string go(uint16_t target, const std::vector<bool> &starts)
+{
+    if (starts[target])
+        return "goto " + label(target) + ";";
+    return "{ pc = " + hex4(target) + "; goto dispatch; }";
+}
+
+// C++ for one decoded instruction at `at`
+static void translate(std::ostream &out, const DecodedInsn &d, uint16_t at, const std::vector<bool> &starts)
+{
+    uint16_t next = at + d.len;
+    std::string imm = hex4(d.imm);
+    std::string imm_next = hex4((uint16_t)(d.imm + 1)); // the second byte of a 16-bit access, wrapped
+    std::string check = "if (patched) { pc = " + hex4(next) + "; goto dispatch; }";
+    out << "    ";
+    switch (d.op)
+    {
+    case D_NOP:
+        out << "// nop";
+        break;
+    case D_LD_A:
+        out << "a = " << imm << ";";
+        break;
+    case D_LD_B:
+        out << "b = " << imm << ";";
+        break;
+    case D_LD_C:
+        out << "c = " << imm << ";";
+        break;
+    case D_MOV_A_B:
+        out << "a = b;";
+        break;
+    case D_MOV_B_A:
+        out << "b = a;";
+        break;
+    case D_INC_A:
+        out << "++a;";
+        break;
+    case D_INC_B:
+        out << "++b;";
+        break;
+    case D_INC_C:
+        out << "++c;";
+        break;
+    case D_ADD:
+        out << "a += b;";
+        break;
+    case D_SUB:
+        out << "a -= b;";
+        break;
+    case D_MUL:
+        out << "a *= b;";
+        break;
+    case D_DIV:
+        out << "if (b != 0) a /= b;";
+        break;
+    case D_MOD:
+        out << "if (b != 0) a %= b;";
+        break;
+    case D_AND:
+        out << "a &= b;";
+        break;
+    case D_OR:
+        out << "a |= b;";
+        break;
+    case D_XOR:
+        out << "a ^= b;";
+        break;
+    case D_NOT:
+        out << "a = ~a;";
+        break;
+    case D_SHL:
+        out << "a <<= 1;";
+        break;
+    case D_SHR:
+        out << "a >>= 1;";
+        break;
+    case D_PRINT_A:
+    case D_PRINT_R_A:
+        out << "put_dec(a);";
+        break;
+    case D_PRINT_R_B:
+        out << "put_dec(b);";
+        break;
+    case D_PRINT_R_C:
+        out << "put_dec(c);";
+        break;
+    case D_PRINT_R_BAD:
+        out << "fault(\"Unknown register: %c\\n\", " << d.imm << "); return;";
+        break;
+    case D_PRINT_CHAR:
+        out << "put_char(a & 0xFF);";
+        break;
+    case D_IN_A:
+        out << "flush_out(); a = getchar();";
+        break;
+    case D_JMP:
+        out << go(d.imm, starts);
+        break;
+    case D_JZ:
+        out << "if (zero_flag) " << go(d.imm, starts);
+        break;
+    case D_JNZ:
+        out << "if (!zero_flag) " << go(d.imm, starts);
+        break;
+    case D_JN:
+        out << "if (negative_flag) " << go(d.imm, starts);
+        break;
+    case D_JP:
+        out << "if (!negative_flag && !zero_flag) " << go(d.imm, starts);
+        break;
+    case D_JEQ:
+        out << "if (b == c) " << go(d.imm, starts);
+        break;
+    case D_JGT:
+        out << "if (b > c) " << go(d.imm, starts);
+        break;
+    case D_JLT:
+        out << "if (b < c) " << go(d.imm, starts);
+        break;
+    case D_CMP:
+        out << "zero_flag = (c == b); negative_flag = (b < c);";
+        break;
+    case D_LOAD8_A:
+        out << "a = memory[" << imm << "];";
+        break;
+    case D_LOAD8_B:
+        out << "b = memory[" << imm << "];";
+        break;
+    case D_LOAD16_A:
+        out << "a = memory[" << imm << "] | (memory[" << imm_next << "] << 8);";
+        break;
+    case D_LOAD16_B:
+        out << "b = memory[" << imm << "] | (memory[" << imm_next << "] << 8);";
+        break;
+    case D_LOAD16BE_A:
+        out << "a = (memory[" << imm << "] << 8) | memory[" << imm_next << "];";
+        break;
+    case D_STORE8_A:
+        out << "store8(" << imm << ", a & 0xFF); " << check;
+        break;
+    case D_STORE16_A:
+        out << "store16(" << imm << ", a); " << check;
+        break;
+    case D_STORE16_B:
+        out << "store16(" << imm << ", b); " << check;
+        break;
+    case D_STORE_IMM8:
+        out << "store8(" << imm << ", " << (d.imm2 & 0xFF) << "); " << check;
+        break;
+    case D_STORE_IMM16:
+        out << "store8(" << imm << ", " << (d.imm2 >> 8) << "); store8(" << imm_next << ", "
+            << (d.imm2 & 0xFF) << "); " << check;
+        break;
+    case D_MEMCPY:
+        out << "block_copy(a, b, c); " << check;
+        break;
+    case D_MEMSET:
+        out << "block_fill(a, b & 0xFF, c); " << check;
+        break;
+    case D_MEMCMP:
+        out << "block_compare(a, b, c);";
+        break;
+    case D_BANK:
+        out << "select_bank(a); if (!running) return; " << check;
+        break;
+    case D_VLOAD:
+    case D_VSTORE:
+    case D_VSPLAT:
+    case D_VADD:
+    case D_VSUB:
+    case D_VAND:
+    case D_VOR:
+    case D_VXOR:
+    case D_VCMPEQ:
+    case D_VCMPGT:
+    case D_VSUM:
+    case D_VMIN:
+    case D_VMAX:
+        out << "vector_op(" << hex4(VLOAD + (d.op - D_VLOAD)) << ", " << d.imm << ", " << d.imm2 << ");";
+        if (d.op == D_VSTORE)
+            out << " " << check;
+        break;
+    case D_CALL:
+        out << "if (!push(" << hex4(next) << ")) { stack_fault(true, " << hex4(at) << "); return; } "
+            << "if (patched) { pc = " << imm << "; goto dispatch; } " << go(d.imm, starts);
+        break;
+    case D_RET:
+        out << "if (!pop(pc)) { stack_fault(false, " << hex4(at) << "); return; } goto dispatch;";
+        break;
+    case D_PUSH_A:
+        out << "if (!push(a)) { stack_fault(true, " << hex4(at) << "); return; } " << check;
+        break;
+    case D_PUSH_B:
+        out << "if (!push(b)) { stack_fault(true, " << hex4(at) << "); return; } " << check;
+        break;
+    case D_POP_A:
+        out << "if (!pop(a)) { stack_fault(false, " << hex4(at) << "); return; }";
+        break;
+    case D_POP_B:
+        out << "if (!pop(b)) { stack_fault(false, " << hex4(at) << "); return; }";
+        break;
+    case D_WAIT:
+        out << "guest_wait(" << d.imm << ");";
+        break;
+    case D_SYSCALL:
+        out << "guest_syscall(); if (!running) return; " << check;
+        break;
+    case D_INT:
+        out << "if (interrupt(" << d.imm << ")) goto dispatch; if (!running) return;";
+        break;
+    case D_RESET:
+        out << "reset(); goto dispatch;";
+        break;
+    case D_HALT:
+        out << "running = false; return;";
+        break;
+    default: // D_ILLEGAL
+        out << "fault(\"Unknown opcode: %d at PC: %u\\n\", " << d.imm << ", " << at << "); return;";
+        break;
+    }
+    out << "\n";
+}
+
+bool write_aot(const std::string &path, const VM &vm, const std::vector<ObjectSection> &sections)
+{
+    ControlFlowGraph graph;
+    graph.build(vm.memory, sections, vm.cpu.pc);
+    std::vector<bool> starts(0x10000, false);
+    for (const BasicBlock &block : graph.blocks())
+        starts[block.start] = true;
+
+    std::ofstream out(path);
+    out << "// Translated from a HexaVM program. Build with: g++ -O2 -o program " << path << "\n";
+    out << "#include <cerrno>\n#include <chrono>\n#include <cstdarg>\n#include <cstdint>\n#include <cstdio>\n"
+           "#include <cstdlib>\n#include <cstring>\n#include <thread>\n#include <unistd.h>\n\n";
+
+    out << "enum Opcode\n{\n";
+#define AOT_OPCODE(name) out << "    " #name " = " << hex4(name).replace(2, 2, "") << ",\n";
+    AOT_OPCODE(NOP) AOT_OPCODE(LDA_IMM) AOT_OPCODE(LDB_IMM) AOT_OPCODE(LDC_IMM) AOT_OPCODE(ADD)
+    AOT_OPCODE(SUB) AOT_OPCODE(MUL) AOT_OPCODE(DIV) AOT_OPCODE(MOD) AOT_OPCODE(AND) AOT_OPCODE(OR)
+    AOT_OPCODE(XOR) AOT_OPCODE(NOT) AOT_OPCODE(SHL) AOT_OPCODE(SHR) AOT_OPCODE(INC)
+    AOT_OPCODE(PRINT_A) AOT_OPCODE(PRINT_R) AOT_OPCODE(PRINT_CHAR) AOT_OPCODE(IN_A)
+    AOT_OPCODE(JMP) AOT_OPCODE(JZ) AOT_OPCODE(JNZ) AOT_OPCODE(JN) AOT_OPCODE(JP) AOT_OPCODE(JEQ)
+    AOT_OPCODE(JGT) AOT_OPCODE(JLT) AOT_OPCODE(CMP) AOT_OPCODE(HLT) AOT_OPCODE(HALT)
+    AOT_OPCODE(LOAD_A_MEM) AOT_OPCODE(STORE_A_MEM) AOT_OPCODE(LOAD8_A_MEM) AOT_OPCODE(STORE8_A_MEM)
+    AOT_OPCODE(MEMCPY) AOT_OPCODE(MEMSET) AOT_OPCODE(MEMCMP) AOT_OPCODE(BANK)
+    AOT_OPCODE(VLOAD) AOT_OPCODE(VSTORE) AOT_OPCODE(VSPLAT) AOT_OPCODE(VADD) AOT_OPCODE(VSUB)
+    AOT_OPCODE(VAND) AOT_OPCODE(VOR) AOT_OPCODE(VXOR) AOT_OPCODE(VCMPEQ) AOT_OPCODE(VCMPGT)
+    AOT_OPCODE(VSUM) AOT_OPCODE(VMIN) AOT_OPCODE(VMAX)
+    AOT_OPCODE(MOV_MEM_IMM) AOT_OPCODE(MOV8_MEM_IMM) AOT_OPCODE(MOV_REG_IMM) AOT_OPCODE(MOV_REG_REG)
+    AOT_OPCODE(MOV_MEM_REG) AOT_OPCODE(MOV_REG_MEM2) AOT_OPCODE(MOV_REG_MEM) AOT_OPCODE(LOAD)
+    AOT_OPCODE(STORE) AOT_OPCODE(CALL) AOT_OPCODE(RET) AOT_OPCODE(PUSH_A) AOT_OPCODE(POP_A)
+    AOT_OPCODE(PUSH_B) AOT_OPCODE(POP_B) AOT_OPCODE(WAIT) AOT_OPCODE(SYSCALL) AOT_OPCODE(INT)
+    AOT_OPCODE(RESET)
+#undef AOT_OPCODE
+    out << "};\n\n";
+    out << "#define START " << hex4(vm.cpu.pc) << "\n";
+    out << "#define ENTRY " << hex4(vm.instruction_base) << "\n";
+    out << "#define STACK_TOP " << hex4(vm.stack_top) << "\n";
+    out << "#define STACK_LIMIT " << (vm.stack_top - vm.stack_size + 2) << "\n";
+    out << "#define REALTIME " << (vm.wait_mode == WAIT_REALTIME) << "\n";
+    out << "#define BANK_WINDOW " << hex4(BANK_WINDOW) << "\n";
+    out << "#define BANK_SIZE " << hex4(BANK_SIZE) << "\n";
+    out << "#define BANKS " << vm.bank_count << "u\n";
+    out << runtime;
+
+    // The image, section by section
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+        out << "\nstatic const uint8_t section_" << i << "[] = {";
+        for (uint32_t offset = 0; offset < sections[i].size; offset++)
+            out << (offset % 16 ? " " : "\n    ") << (int)vm.memory[sections[i].addr + offset] << ",";
+        out << "\n};\n";
+    }
+    out << "\nstatic void load_image()\n{\n";
+    for (size_t i = 0; i < sections.size(); i++)
+        out << "    memcpy(memory + " << hex4(sections[i].addr) << ", section_" << i << ", sizeof(section_" << i << "));\n";
+    for (const BasicBlock &block : graph.blocks())
+        out << "    block_start[" << hex4(block.start) << "] = true; memset(code_byte + " << hex4(block.start)
+            << ", 1, " << (block.end - block.start) << ");\n";
+    out << "}\n";
+
+    // The translation: a label per block, in address order
+    out << "\nstatic void run()\n{\ndispatch:\n    if (!running)\n        return;\n"
+           "    if (!patched)\n    {\n        switch (pc)\n        {\n";
+    for (const BasicBlock &block : graph.blocks())
+        out << "        case " << hex4(block.start) << ": goto " << label(block.start) << ";\n";
+    out << "        }\n    }\n    interpret();\n    goto dispatch;\n";
+    for (const BasicBlock &block : graph.blocks())
+    {
+        out << label(block.start) << ":\n";
+        DecodedInsn d = {};
+        uint32_t at = block.start;
+        while (at < block.end)
+        {
+            decode_bytes(vm.memory, at, d);
+            translate(out, d, at, starts);
+            at += d.len;
+        }
+        bool falls_through = d.op != D_JMP && d.op != D_RET && d.op != D_HALT && d.op != D_RESET &&
+                             d.op != D_ILLEGAL && d.op != D_PRINT_R_BAD;
+        if (falls_through)
+            out << "    " << go(block.end, starts) << "\n";
+    }
+    out << "}\n\nint main()\n{\n    load_image();\n    run();\n    flush_out();\n    return 0;\n}\n";
+
+    if (!out)
+    {
+        std::cerr << "Error: Could not write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "object.h"
+#include <string>
+#include <vector>
+
+class VM;
+
+// Ahead-of-time translation of the program loaded in `vm` (its memory, the
+// `sections` that hold it, entry point, stack and wait settings) into one
+// standalone C++ file. Built with g++ -O2, the file gives an executable
+// whose output is what VM::start() would print.
+//
+// Each basic block of the code sections (cfg.h) becomes a labelled run of
+// C++ in a single function, so direct jumps, branches and calls are gotos.
+// Returns and jumps to an address where no block starts go through a
+// switch over the block addresses. Code that is not known to the
+// translation runs on an interpreter embedded in the file. Once the guest
+// writes into translated code, everything runs on that interpreter.
+//
+// Reports on stderr and returns false if the file cannot be written.
+bool write_aot(const std::string &path, const VM &vm, const std::vector<ObjectSection> &sections);
+
+#endif // AOT_H
@@ -1,80 +1,317 @@
 #include "assembler.h"
+#include "cfg.h"
+#include "decode.h"
+#include <cstring>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// Remove comments and trim whitespace from a line
-std::string TextAssembler::preprocessLine(const std::string &line)
+// Fewest source bytes worth handing to a thread of their own
+#define PARALLEL_MIN_BYTES (128 * 1024)
+
+// How an instruction's operands are written in source. They are encoded
+// after the opcode byte in the order the VM reads them, 16-bit fields high
+// byte first. Addresses are hex (with or without 0x); other numbers are
+// decimal unless written with 0x.
+enum OperandFormat : uint8_t
 {
-    std::string result = line;
+    OPS_NONE,            // add
+    OPS_IMM16,           // lda 10
+    OPS_REG,             // inc b
+    OPS_TARGET,          // jmp label|addr, where a number may be decimal
+    OPS_ADDR,            // load_a 0300
+    OPS_ADDR_REG,        // mov_mem_reg 0300 a
+    OPS_REG_ADDR,        // mov_reg_mem a 0300
+    OPS_STORE,           // store a 0300, encoded address first
+    OPS_REG_REG,         // mov_reg_reg a b
+    OPS_ADDR_IMM16,      // mov_mem_imm 0300 1000
+    OPS_ADDR_IMM8,       // mov8_mem_imm 0300 42
+    OPS_REG_IMM16,       // mov_reg_imm a 1000, encoded with an unused 16-bit field
+    OPS_IMM8,            // wait 20
+    OPS_HEX8,            // int 10
+    OPS_VREG,            // vload v0
+    OPS_VREG_VREG        // vadd v0 v1
+};
 
-    // Remove comments (starting with ; or //)
-    auto commentPos = result.find(';');
-    if (commentPos != std::string::npos)
+// Encoded size in bytes, opcode included
+static constexpr uint8_t formatSize(OperandFormat format)
+{
+    return format == OPS_NONE ? 1
+           : format == OPS_REG || format == OPS_IMM8 || format == OPS_HEX8 || format == OPS_VREG ? 2
+           : format == OPS_IMM16 || format == OPS_TARGET || format == OPS_ADDR || format == OPS_REG_REG ? 3
+           : format == OPS_VREG_VREG ? 3
+           : format == OPS_ADDR_IMM16 ? 5
+           : format == OPS_REG_IMM16 ? 6
+                                     : 4;
+}
+
+struct Mnemonic
+{
+    std::string_view name;
+    uint8_t opcode;
+    OperandFormat format;
+    uint8_t size;
+};
+
+#define MNEMONIC(name, opcode, format) {name, opcode, format, formatSize(format)}
+
+static constexpr Mnemonic mnemonics[] = {
+    // Basic Arithmetic & Logic
+    MNEMONIC("nop", NOP, OPS_NONE),       // No operation
+    MNEMONIC("lda", LDA_IMM, OPS_IMM16),  // A = immediate 16-bit
+    MNEMONIC("ldb", LDB_IMM, OPS_IMM16),  // B = immediate 16-bit
+    MNEMONIC("ldc", LDC_IMM, OPS_IMM16),  // C = immediate 16-bit
+    MNEMONIC("add", ADD, OPS_NONE),       // A = A + B
+    MNEMONIC("sub", SUB, OPS_NONE),       // A = A - B
+    MNEMONIC("mul", MUL, OPS_NONE),       // A = A * B
+    MNEMONIC("div", DIV, OPS_NONE),       // A = A / B (if B != 0)
+    MNEMONIC("mod", MOD, OPS_NONE),       // A = A % B (if B != 0)
+    MNEMONIC("and", AND, OPS_NONE),       // A = A & B
+    MNEMONIC("or", OR, OPS_NONE),         // A = A | B
+    MNEMONIC("xor", XOR, OPS_NONE),       // A = A ^ B
+    MNEMONIC("not", NOT, OPS_NONE),       // A = ~A
+    MNEMONIC("shl", SHL, OPS_NONE),       // A = A << 1
+    MNEMONIC("shr", SHR, OPS_NONE),       // A = A >> 1
+    MNEMONIC("inc", INC, OPS_REG),        // Increment register by 1
+
+    // I/O Operations
+    MNEMONIC("printa", PRINT_A, OPS_NONE),    // Print A register as number
+    MNEMONIC("printc", PRINT_CHAR, OPS_NONE), // Print A register as ASCII char
+    MNEMONIC("ina", IN_A, OPS_NONE),          // A = getchar() (input)
+
+    // Memory Operations
+    MNEMONIC("load_a", LOAD_A_MEM, OPS_ADDR),              // A = memory[addr] (16-bit)
+    MNEMONIC("store_a", STORE_A_MEM, OPS_ADDR),            // memory[addr] = A (16-bit)
+    MNEMONIC("load8_a", LOAD8_A_MEM, OPS_ADDR),            // A = memory[addr] (8-bit)
+    MNEMONIC("store8_a", STORE8_A_MEM, OPS_ADDR),          // memory[addr] = A & 0xFF (8-bit)
+    MNEMONIC("mov_mem_imm", MOV_MEM_IMM, OPS_ADDR_IMM16),  // memory[addr] = immediate 16-bit
+    MNEMONIC("mov8_mem_imm", MOV8_MEM_IMM, OPS_ADDR_IMM8), // memory[addr] = immediate 8-bit
+    MNEMONIC("mov_reg_imm", MOV_REG_IMM, OPS_REG_IMM16),   // reg = immediate 16-bit
+    MNEMONIC("mov_reg_reg", MOV_REG_REG, OPS_REG_REG),     // reg1 = reg2
+    MNEMONIC("mov_reg_mem", MOV_REG_MEM, OPS_REG_ADDR),    // reg = memory[addr] (8-bit)
+    MNEMONIC("mov_reg_mem2", MOV_REG_MEM2, OPS_REG_ADDR),  // reg = memory[addr] | (memory[addr+1] << 8) (16-bit)
+    MNEMONIC("mov_mem_reg", MOV_MEM_REG, OPS_ADDR_REG),    // memory[addr] = reg (16-bit)
+    MNEMONIC("load", LOAD, OPS_REG_ADDR),                  // reg = memory[addr]
+    MNEMONIC("store", STORE, OPS_STORE),                   // memory[addr] = reg
+    MNEMONIC("memcpy", MEMCPY, OPS_NONE),                  // copy C bytes from [B] to [A]
+    MNEMONIC("memset", MEMSET, OPS_NONE),                  // fill C bytes at [A] with B
+    MNEMONIC("memcmp", MEMCMP, OPS_NONE),                  // compare C bytes at [A] and [B]
+    MNEMONIC("bank", BANK, OPS_NONE),                      // map bank A at 0x4000-0x7FFF
+
+    // Vector Operations: v0-v3, 8 x 16-bit lanes
+    MNEMONIC("vload", VLOAD, OPS_VREG),        // v = 8 words at memory[B]
+    MNEMONIC("vstore", VSTORE, OPS_VREG),      // 8 words at memory[B] = v
+    MNEMONIC("vsplat", VSPLAT, OPS_VREG),      // every lane of v = A
+    MNEMONIC("vadd", VADD, OPS_VREG_VREG),     // v1 += v2
+    MNEMONIC("vsub", VSUB, OPS_VREG_VREG),     // v1 -= v2
+    MNEMONIC("vand", VAND, OPS_VREG_VREG),     // v1 &= v2
+    MNEMONIC("vor", VOR, OPS_VREG_VREG),       // v1 |= v2
+    MNEMONIC("vxor", VXOR, OPS_VREG_VREG),     // v1 ^= v2
+    MNEMONIC("vcmpeq", VCMPEQ, OPS_VREG_VREG), // lanes = v1 == v2 ? 0xFFFF : 0
+    MNEMONIC("vcmpgt", VCMPGT, OPS_VREG_VREG), // lanes = v1 > v2 ? 0xFFFF : 0
+    MNEMONIC("vsum", VSUM, OPS_VREG),          // A = sum of lanes
+    MNEMONIC("vmin", VMIN, OPS_VREG),          // A = smallest lane
+    MNEMONIC("vmax", VMAX, OPS_VREG),          // A = largest lane
+
+    // Control Flow
+    MNEMONIC("jmp", JMP, OPS_TARGET),   // Jump to addr
+    MNEMONIC("jz", JZ, OPS_TARGET),     // Jump if zero flag
+    MNEMONIC("jnz", JNZ, OPS_TARGET),   // Jump if not zero flag
+    MNEMONIC("jn", JN, OPS_TARGET),     // Jump if negative flag
+    MNEMONIC("jp", JP, OPS_TARGET),     // Jump if positive (not negative and not zero)
+    MNEMONIC("jeq", JEQ, OPS_TARGET),   // Jump if B == C
+    MNEMONIC("jgt", JGT, OPS_TARGET),   // Jump if B > C
+    MNEMONIC("jlt", JLT, OPS_TARGET),   // Jump if B < C
+    MNEMONIC("call", CALL, OPS_TARGET), // Push PC to stack and jump to addr
+    MNEMONIC("ret", RET, OPS_NONE),     // Pop PC from stack
+
+    // Stack Operations
+    MNEMONIC("push_a", PUSH_A, OPS_NONE), // Push A to stack
+    MNEMONIC("pop_a", POP_A, OPS_NONE),   // Pop from stack into A
+    MNEMONIC("push_b", PUSH_B, OPS_NONE), // Push B to stack
+    MNEMONIC("pop_b", POP_B, OPS_NONE),   // Pop from stack into B
+
+    // Comparison
+    MNEMONIC("cmp", CMP, OPS_NONE), // Compare B and C, set flags
+
+    // System & Misc
+    MNEMONIC("wait", WAIT, OPS_IMM8),       // Wait N cycles
+    MNEMONIC("syscall", SYSCALL, OPS_NONE), // System call (A = call number)
+    MNEMONIC("int", INT, OPS_HEX8),         // Interrupt (parameter = interrupt number)
+    MNEMONIC("reset", RESET, OPS_NONE),     // Reset CPU state
+    MNEMONIC("halt", HALT, OPS_NONE),       // Halt execution
+};
+
+#undef MNEMONIC
+
+// Mnemonics are found through a hash table built at compile time. The seed
+// was picked so that no two mnemonics share a slot, which the static_assert
+// below checks: a lookup is one hash, one probe and one compare. After
+// adding a mnemonic, try other seeds until it holds again.
+#define MNEMONIC_SEED 0x811d3e18u
+#define MNEMONIC_SLOTS 256
+
+static constexpr uint8_t mnemonicHash(std::string_view name)
+{
+    uint32_t hash = MNEMONIC_SEED; // FNV-1a
+    for (char c : name)
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    return (hash ^ (hash >> 16)) & (MNEMONIC_SLOTS - 1);
+}
+
+struct MnemonicIndex
+{
+    int8_t slot[MNEMONIC_SLOTS]; // index into mnemonics[], or -1
+    bool perfect;                // no two mnemonics hash to one slot
+};
+
+static constexpr MnemonicIndex buildMnemonicIndex()
+{
+    MnemonicIndex index = {};
+    for (int i = 0; i < MNEMONIC_SLOTS; i++)
+        index.slot[i] = -1;
+    index.perfect = true;
+    for (size_t i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); i++)
     {
-        result = result.substr(0, commentPos);
+        uint8_t slot = mnemonicHash(mnemonics[i].name);
+        if (index.slot[slot] >= 0)
+            index.perfect = false;
+        index.slot[slot] = i;
     }
+    return index;
+}
+
+static constexpr MnemonicIndex mnemonicIndex = buildMnemonicIndex();
+static_assert(mnemonicIndex.perfect, "mnemonic hash collision: change MNEMONIC_SEED");
+
+// Table entry for a mnemonic, or nullptr if there is none
+static const Mnemonic *findMnemonic(std::string_view name)
+{
+    int8_t i = mnemonicIndex.slot[mnemonicHash(name)];
+    return i >= 0 && mnemonics[i].name == name ? &mnemonics[i] : nullptr;
+}
+
+static bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
 
-    commentPos = result.find("//");
-    if (commentPos != std::string::npos)
+static std::string_view trim(std::string_view text)
+{
+    while (!text.empty() && isBlank(text.front()))
+        text.remove_prefix(1);
+    while (!text.empty() && isBlank(text.back()))
+        text.remove_suffix(1);
+    return text;
+}
+
+// Take the next line, without its '\n', off the front of `text`
+static std::string_view nextLine(std::string_view &text)
+{
+    size_t end = text.find('\n');
+    std::string_view line = text.substr(0, end);
+    text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+    return line;
+}
+
+// Take the next token off `text`; tokens are separated by blanks and commas
+static std::string_view nextToken(std::string_view &text)
+{
+    size_t start = 0;
+    while (start < text.size() && (isBlank(text[start]) || text[start] == ','))
+        start++;
+    size_t end = start;
+    while (end < text.size() && !isBlank(text[end]) && text[end] != ',')
+        end++;
+    std::string_view token = text.substr(start, end - start);
+    text.remove_prefix(end);
+    return token;
+}
+
+// Parse all of `token` as a number in `base`, or as hex when it starts with
+// 0x. Returns false if it is empty, has stray characters or exceeds `max`.
+static bool parseNumber(std::string_view token, int base, uint32_t max, uint32_t &value)
+{
+    if (token.size() > 2 && token[0] == '0' && (token[1] == 'x' || token[1] == 'X'))
     {
-        result = result.substr(0, commentPos);
+        token.remove_prefix(2);
+        base = 16;
     }
+    if (token.empty())
+        return false;
+    value = 0;
+    for (char c : token)
+    {
+        int digit = c >= '0' && c <= '9'   ? c - '0'
+                    : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                    : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                           : base;
+        if (digit >= base)
+            return false;
+        value = value * base + digit;
+        if (value > max)
+            return false;
+    }
+    return true;
+}
 
-    // Trim leading whitespace
-    result.erase(result.begin(),
-                 std::find_if(result.begin(), result.end(),
-                              [](unsigned char ch)
-                              { return !std::isspace(ch); }));
+// Remove comments and trim whitespace from a line
+std::string_view TextAssembler::preprocessLine(std::string_view line)
+{
+    // Remove comments (starting with ; or //)
+    size_t commentPos = line.find(';');
+    if (commentPos != std::string_view::npos)
+    {
+        line = line.substr(0, commentPos);
+    }
 
-    // Trim trailing whitespace
-    result.erase(std::find_if(result.rbegin(), result.rend(),
-                              [](unsigned char ch)
-                              { return !std::isspace(ch); })
-                     .base(),
-                 result.end());
+    commentPos = line.find("//");
+    if (commentPos != std::string_view::npos)
+    {
+        line = line.substr(0, commentPos);
+    }
 
-    return result;
+    return trim(line);
 }
 
-// Check if line contains a label definition
-bool TextAssembler::isLabelDefinition(const std::string &line, std::string &label)
+// Check if line contains a label definition; if so, split it off the line
+bool TextAssembler::isLabelDefinition(std::string_view &line, std::string_view &label)
 {
     size_t colonPos = line.find(':');
-    if (colonPos != std::string::npos)
-    {
-        label = line.substr(0, colonPos);
-        // Trim potential whitespace
-        label.erase(label.begin(),
-                    std::find_if(label.begin(), label.end(),
-                                 [](unsigned char ch)
-                                 { return !std::isspace(ch); }));
+    if (colonPos != std::string_view::npos)
+    {
+        label = trim(line.substr(0, colonPos));
+        line = trim(line.substr(colonPos + 1));
         return true;
     }
     return false;
 }
 
-// First pass: record label positions and calculate addresses
-void TextAssembler::firstPass(const std::vector<std::string> &code)
+// First pass over the lines of `source`: record label positions and sizes,
+// relative to the start address until an .org gives an absolute one
+void TextAssembler::layoutLines(std::string_view source, ChunkLayout &layout)
 {
-    currentAddress = 0x9000; // Reset to default start address
-    symbolTable.clear();
-    forwardRefs.clear();
-
-    for (const auto &rawLine : code)
+    uint16_t address = 0;
+    while (!source.empty())
     {
-        std::string line = preprocessLine(rawLine);
+        std::string_view line = preprocessLine(nextLine(source));
         if (line.empty())
         {
             continue; // Skip empty lines
         }
 
-        std::string label;
+        std::string_view label;
         if (isLabelDefinition(line, label))
         {
             // Record label position
-            symbolTable[label] = currentAddress;
-
-            // Remove label from line for further processing
-            line = line.substr(line.find(':') + 1);
-            line = preprocessLine(line); // Clean up again after removing label
+            layout.labels.emplace_back(label, address);
+            if (!layout.hasOrg)
+                layout.relativeLabels++;
 
             if (line.empty())
             {
@@ -83,327 +320,1002 @@ void TextAssembler::firstPass(const std::vector<std::string> &code)
         }
 
         // Handle directives
-        std::istringstream iss(line);
-        std::string directive;
-        iss >> directive;
+        std::string_view directive = nextToken(line);
 
         if (directive == ".org")
         {
-            uint16_t addr;
-            iss >> std::hex >> addr;
-            currentAddress = addr;
+            uint32_t addr;
+            if (parseNumber(nextToken(line), 16, 0xFFFF, addr))
+            {
+                address = addr;
+                layout.hasOrg = true;
+            }
             continue;
         }
         else if (directive == ".db")
         {
-            // Process data bytes directive
-            uint8_t value;
-            while (iss >> value)
-            {
-                // Just increment the address counter for first pass
-                currentAddress++;
-
-                // Skip any commas
-                char comma;
-                iss >> comma;
-            }
+            // Just advance the address counter for first pass
+            address += parseDataBytes(line).size();
             continue;
         }
+        else if (directive == ".entry")
+        {
+            continue; // resolved in the second pass, once labels are known
+        }
 
         // For normal instructions, increment address based on instruction size
-        if (opcodeMap.find(directive) != opcodeMap.end())
+        const Mnemonic *mnemonic = findMnemonic(directive);
+        if (mnemonic)
         {
-            if (instructionSize.find(directive) != instructionSize.end())
-            {
-                currentAddress += instructionSize[directive];
-            }
-            else
-            {
-                std::cerr << "Warning: Unknown instruction size for " << directive << std::endl;
-                currentAddress += 1; // Default size
-            }
+            address += mnemonic->size;
         }
     }
+    layout.end = address;
+}
 
-    // Debug output
-    std::cout << "Symbol table after first pass:" << std::endl;
-    for (const auto &symbol : symbolTable)
+// Enter a laid-out run that starts at `base` into the symbol table (a
+// later definition of a label wins) and return the address after it
+uint16_t TextAssembler::placeChunk(const ChunkLayout &layout, uint16_t base)
+{
+    for (size_t i = 0; i < layout.labels.size(); i++)
+    {
+        uint16_t addr = layout.labels[i].second;
+        symbolTable[std::string(layout.labels[i].first)] = i < layout.relativeLabels ? base + addr : addr;
+    }
+    return layout.hasOrg ? layout.end : base + layout.end;
+}
+
+// First pass: record label positions and calculate addresses
+void TextAssembler::firstPass(std::string_view source)
+{
+    isSecondPass = false;
+    symbolTable.clear();
+
+    ChunkLayout layout;
+    layoutLines(source, layout);
+    currentAddress = placeChunk(layout, 0x9000); // default start address
+}
+
+uint8_t TextAssembler::readRegister(std::string_view &operands)
+{
+    std::string_view token = nextToken(operands);
+    if (token.empty())
+    {
+        *errors << "Error: Missing register operand" << std::endl;
+        return 0;
+    }
+    return token[0];
+}
+
+// v0 to v3, encoded as the register number
+uint8_t TextAssembler::readVectorRegister(std::string_view &operands)
+{
+    std::string_view token = nextToken(operands);
+    if (token.size() != 2 || token[0] != 'v' || token[1] < '0' || token[1] >= '0' + VECTOR_REGS)
+    {
+        *errors << "Error: Bad vector register '" << token << "'" << std::endl;
+        return 0;
+    }
+    return token[1] - '0';
+}
+
+uint16_t TextAssembler::readNumber(std::string_view &operands, int base, uint32_t max)
+{
+    std::string_view token = nextToken(operands);
+    uint32_t value = 0;
+    if (!parseNumber(token, base, max, value))
     {
-        std::cout << symbol.first << " = 0x" << std::hex << symbol.second << std::endl;
+        *errors << "Error: Bad number '" << token << "'" << std::endl;
     }
+    return value;
+}
+
+// A jump target: a label, or an address in hex (0x...) or decimal
+uint16_t TextAssembler::readTarget(std::string_view &operands)
+{
+    std::string_view token = nextToken(operands);
+    uint32_t addr = 0;
+    if (!token.empty() && std::isdigit((unsigned char)token[0]))
+    {
+        if (!parseNumber(token, 10, 0xFFFF, addr))
+            *errors << "Error: Bad address '" << token << "'" << std::endl;
+        return addr;
+    }
+
+    referencedLabel = token;
+    const SymbolTable &table = sharedSymbols ? *sharedSymbols : symbolTable;
+    auto symbol = table.find(token);
+    if (symbol == table.end())
+    {
+        *errors << "Error: Undefined label '" << token << "'" << std::endl;
+        return 0; // Use dummy address
+    }
+    return symbol->second;
+}
+
+// Store a 16-bit operand, high byte first
+void TextAssembler::emit16(uint16_t value)
+{
+    memory[currentAddress++] = (value >> 8) & 0xFF; // High byte
+    memory[currentAddress++] = value & 0xFF;        // Low byte
 }
 
 // Parse and assemble a single instruction (second pass)
-void TextAssembler::parseLine(const std::string &rawLine)
+void TextAssembler::parseLine(std::string_view rawLine)
 {
-    std::string line = preprocessLine(rawLine);
+    std::string_view line = preprocessLine(rawLine);
     if (line.empty())
     {
         return; // Skip empty lines
     }
 
-    std::string label;
-    if (isLabelDefinition(line, label))
+    std::string_view label;
+    if (isLabelDefinition(line, label) && line.empty())
     {
-        // Skip label in second pass - already processed in first pass
-        line = line.substr(line.find(':') + 1);
-        line = preprocessLine(line);
-
-        if (line.empty())
-        {
-            return; // Skip if only label on line
-        }
+        return; // Skip if only label on line - already processed in first pass
     }
 
-    std::istringstream iss(line);
-    std::string directive;
-    iss >> directive;
+    std::string_view directive = nextToken(line);
 
     // Handle directives
     if (directive == ".org")
     {
-        uint16_t addr;
-        iss >> std::hex >> addr;
-        currentAddress = addr;
+        currentAddress = readNumber(line, 16);
+        return;
+    }
+    else if (directive == ".db")
+    {
+        uint16_t start = currentAddress;
+        for (uint8_t value : parseDataBytes(line))
+        {
+            memory[currentAddress++] = value;
+        }
+        noteEmitted(start, SECTION_DATA);
+        return;
+    }
+    else if (directive == ".entry")
+    {
+        entryPoint = readTarget(line);
+        entrySet = true;
         return;
     }
 
     // Not a directive, should be an opcode
-    std::string opcode = directive;
+    const Mnemonic *mnemonic = findMnemonic(directive);
+    if (!mnemonic)
+    {
+        *errors << "Unknown opcode: " << directive << std::endl;
+        return;
+    }
+
+    uint16_t start = currentAddress;
+    memory[currentAddress++] = mnemonic->opcode;
 
-    if (opcodeMap.find(opcode) == opcodeMap.end())
+    // Operands, in the order the VM reads them
+    switch (mnemonic->format)
+    {
+    case OPS_NONE:
+        break;
+    case OPS_IMM16:
+        emit16(readNumber(line, 10));
+        break;
+    case OPS_REG:
+        memory[currentAddress++] = readRegister(line);
+        break;
+    case OPS_TARGET:
+        emit16(readTarget(line));
+        break;
+    case OPS_ADDR:
+        emit16(readNumber(line, 16));
+        break;
+    case OPS_ADDR_REG:
+        emit16(readNumber(line, 16));
+        memory[currentAddress++] = readRegister(line);
+        break;
+    case OPS_STORE:
     {
-        std::cerr << "Unknown opcode: " << opcode << std::endl;
+        uint8_t reg = readRegister(line);
+        emit16(readNumber(line, 16));
+        memory[currentAddress++] = reg;
+        break;
+    }
+    case OPS_REG_ADDR:
+        memory[currentAddress++] = readRegister(line);
+        emit16(readNumber(line, 16));
+        break;
+    case OPS_REG_REG:
+        memory[currentAddress++] = readRegister(line);
+        memory[currentAddress++] = readRegister(line);
+        break;
+    case OPS_ADDR_IMM16:
+        emit16(readNumber(line, 16));
+        emit16(readNumber(line, 10));
+        break;
+    case OPS_ADDR_IMM8:
+        emit16(readNumber(line, 16));
+        memory[currentAddress++] = readNumber(line, 10, 0xFF);
+        break;
+    case OPS_REG_IMM16:
+        memory[currentAddress++] = readRegister(line);
+        emit16(0);
+        emit16(readNumber(line, 10));
+        break;
+    case OPS_IMM8:
+        memory[currentAddress++] = readNumber(line, 10, 0xFF);
+        break;
+    case OPS_HEX8:
+        memory[currentAddress++] = readNumber(line, 16, 0xFF);
+        break;
+    case OPS_VREG:
+        memory[currentAddress++] = readVectorRegister(line);
+        break;
+    case OPS_VREG_VREG:
+        memory[currentAddress++] = readVectorRegister(line);
+        memory[currentAddress++] = readVectorRegister(line);
+        break;
+    }
+
+    noteEmitted(start, SECTION_CODE);
+}
+
+// Values of a .db line: numbers (decimal, or hex with 0x) separated by
+// commas and/or spaces
+std::vector<uint8_t> TextAssembler::parseDataBytes(std::string_view operands)
+{
+    std::vector<uint8_t> bytes;
+    for (std::string_view token = nextToken(operands); !token.empty(); token = nextToken(operands))
+    {
+        uint32_t value;
+        if (!parseNumber(token, 10, 0xFF, value))
+        {
+            if (isSecondPass)
+                *errors << "Error: Bad .db value '" << token << "'" << std::endl;
+            continue;
+        }
+        bytes.push_back(value);
+    }
+    return bytes;
+}
+
+// Record that [start, currentAddress) now holds bytes of `kind`, growing the
+// last section when they follow on from it
+void TextAssembler::noteEmitted(uint16_t start, uint16_t kind)
+{
+    uint16_t size = currentAddress - start;
+    if (size == 0)
         return;
+    // A run that wrapped past 0xFFFF becomes two sections
+    uint32_t head = std::min<uint32_t>(size, 0x10000 - start);
+    ObjectSection section = {start, kind, head};
+    appendSection(section);
+    if (head < size)
+    {
+        ObjectSection wrapped = {0, kind, size - head};
+        appendSection(wrapped);
     }
+}
 
-    memory[currentAddress++] = opcodeMap[opcode];
+void TextAssembler::appendSection(const ObjectSection &section)
+{
+    if (!sectionList.empty())
+    {
+        ObjectSection &last = sectionList.back();
+        if (last.kind == section.kind && last.addr + last.size == section.addr)
+        {
+            last.size += section.size;
+            return;
+        }
+    }
+    sectionList.push_back(section);
+}
 
-    // Handle operands based on instruction type
+// Assemble multiple lines (second pass)
+void TextAssembler::doSecondPass(std::string_view source)
+{
+    isSecondPass = true;
+    currentAddress = 0x9000; // Reset to default start address
+    entryPoint = 0x9000;
+    entrySet = false;
+    sectionList.clear();
 
-    // No operands instructions
-    if (opcode == "nop" || opcode == "add" || opcode == "sub" || opcode == "mul" ||
-        opcode == "div" || opcode == "mod" || opcode == "printa" || opcode == "printc" ||
-        opcode == "and" || opcode == "or" || opcode == "xor" || opcode == "not" ||
-        opcode == "shl" || opcode == "shr" || opcode == "ina" || opcode == "ret" ||
-        opcode == "halt" || opcode == "reset" || opcode == "push_a" || opcode == "pop_a" ||
-        opcode == "push_b" || opcode == "pop_b" || opcode == "cmp")
+    while (!source.empty())
     {
-        // No additional operands needed
+        if (lineAddresses)
+            lineAddresses->push_back(currentAddress);
+        parseLine(nextLine(source));
     }
-    // Register + immediate value instructions
-    else if (opcode == "lda" || opcode == "ldb" || opcode == "ldc")
+}
+
+// Peephole optimisation. The source is split into statements, the rules in
+// peepholeRules delete wasted instructions from them, and what is left is
+// written back out as source for the usual two passes, so every label gets
+// its address in the shrunk program.
+
+// One line of source as the peephole pass sees it
+struct Statement
+{
+    std::string_view label;    // defined on this line, or empty
+    std::string_view op;       // mnemonic or directive, or empty
+    std::string_view operands; // the rest of the line, comment removed
+    bool removed;              // dropped; its label stays
+};
+
+// What a rule looks at: the instruction at `first` and the next statement
+// with an op, at `second`. `labelled` says a label sits on or before
+// `second`, so it can be reached without passing through `first`.
+struct PeepholeWindow
+{
+    std::vector<Statement> &statements;
+    const std::map<std::string_view, int> &labelCounts;
+    PeepholeStats &stats;
+    size_t first, second;
+    bool labelled;
+
+    Statement &a() { return statements[first]; }
+    Statement &b() { return statements[second]; }
+
+    void remove(size_t index)
     {
-        uint16_t value;
-        iss >> value;
-        memory[currentAddress++] = (value >> 8) & 0xFF; // High byte
-        memory[currentAddress++] = value & 0xFF;        // Low byte
+        statements[index].removed = true;
+        stats.instructions++;
+        stats.bytes += findMnemonic(statements[index].op)->size;
     }
-    // Single register instructions
-    else if (opcode == "inc")
+};
+
+static bool isBranch(std::string_view op)
+{
+    return op == "jmp" || op == "jz" || op == "jnz" || op == "jn" || op == "jp" ||
+           op == "jeq" || op == "jgt" || op == "jlt" || op == "call";
+}
+
+// The register an instruction sets without reading it, or 0. Loads from
+// the stack are left out: popping an empty stack faults.
+static char overwrites(const Statement &statement)
+{
+    std::string_view op = statement.op;
+    if (op == "lda")
+        return 'a';
+    if (op == "ldb")
+        return 'b';
+    if (op == "ldc")
+        return 'c';
+    if (op == "vsum" || op == "vmin" || op == "vmax")
+        return 'a';
+    if (op == "mov_reg_reg")
     {
-        char reg;
-        iss >> reg;
-        memory[currentAddress++] = reg;
+        // "a" copies B into A; any other register copies A into B
+        std::string_view operands = statement.operands;
+        std::string_view reg = nextToken(operands);
+        return !reg.empty() && reg[0] == 'a' ? 'a' : 'b';
     }
-    // Jump/branch instructions (address operand)
-    else if (opcode == "jmp" || opcode == "jz" || opcode == "jnz" || opcode == "jn" ||
-             opcode == "jp" || opcode == "jeq" || opcode == "jgt" || opcode == "jlt" ||
-             opcode == "call")
+    return 0;
+}
+
+// lda 1 / lda 2: the first load is never seen
+static bool deadLoad(PeepholeWindow &w)
+{
+    char reg = overwrites(w.a());
+    if (!reg || overwrites(w.b()) != reg)
+        return false;
+    w.remove(w.first);
+    return true;
+}
+
+// push_a / pop_a leaves both the register and SP as they were. The pair
+// also wrote the slot below SP and could overflow a full stack; the
+// README lists that among the -O caveats.
+static bool pushPop(PeepholeWindow &w)
+{
+    if (w.labelled || !((w.a().op == "push_a" && w.b().op == "pop_a") ||
+                        (w.a().op == "push_b" && w.b().op == "pop_b")))
+        return false;
+    w.remove(w.first);
+    w.remove(w.second);
+    return true;
+}
+
+// jmp next / next: a jump, taken or not, to where execution goes anyway
+static bool jumpToNext(PeepholeWindow &w)
+{
+    if (!isBranch(w.a().op) || w.a().op == "call" || !w.labelled)
+        return false;
+    std::string_view operands = w.a().operands;
+    std::string_view target = nextToken(operands);
+    auto count = w.labelCounts.find(target);
+    if (count == w.labelCounts.end() || count->second != 1)
+        return false;
+    for (size_t i = w.first + 1; i <= w.second; i++)
     {
-        std::string addrOrLabel;
-        iss >> addrOrLabel;
+        if (w.statements[i].label == target)
+        {
+            w.remove(w.first);
+            return true;
+        }
+    }
+    return false;
+}
 
-        // Check if it's a label (not starting with 0x)
-        if (addrOrLabel.size() >= 2 && addrOrLabel.substr(0, 2) != "0x")
+// Each rule returns true if it removed something. Rules see the program
+// after earlier removals, so chains of waste collapse completely.
+struct PeepholeRule
+{
+    const char *name;
+    bool (*apply)(PeepholeWindow &w);
+};
+
+static const PeepholeRule peepholeRules[] = {
+    {"dead register load", deadLoad},
+    {"push/pop pair", pushPop},
+    {"jump to next instruction", jumpToNext},
+};
+
+// The next statement after `index` that has an op, or statements.size()
+static size_t nextStatement(const std::vector<Statement> &statements, size_t index, bool &labelled)
+{
+    labelled = false;
+    for (index++; index < statements.size(); index++)
+    {
+        labelled |= !statements[index].label.empty();
+        if (!statements[index].removed && !statements[index].op.empty())
+            break;
+    }
+    return index;
+}
+
+// Apply peepholeRules everywhere until none fires
+static void applyPeepholeRules(std::vector<Statement> &statements,
+                               const std::map<std::string_view, int> &labelCounts, PeepholeStats &stats)
+{
+    for (size_t i = 0; i < statements.size();)
+    {
+        bool fired = false;
+        if (!statements[i].removed && findMnemonic(statements[i].op))
         {
-            // It's a label, look it up in symbol table
-            if (symbolTable.find(addrOrLabel) != symbolTable.end())
+            PeepholeWindow window = {statements, labelCounts, stats, i, 0, false};
+            window.second = nextStatement(statements, i, window.labelled);
+            if (window.second < statements.size() && findMnemonic(statements[window.second].op))
             {
-                uint16_t addr = symbolTable[addrOrLabel];
-                memory[currentAddress++] = (addr >> 8) & 0xFF; // High byte
-                memory[currentAddress++] = addr & 0xFF;        // Low byte
-            }
-            else
-            {
-                std::cerr << "Error: Undefined label '" << addrOrLabel << "'" << std::endl;
-                // Use dummy address
-                memory[currentAddress++] = 0;
-                memory[currentAddress++] = 0;
+                for (const PeepholeRule &rule : peepholeRules)
+                {
+                    if (rule.apply(window))
+                    {
+                        stats.rules[rule.name]++;
+                        fired = true;
+                        break;
+                    }
+                }
             }
         }
-        else
+        if (!fired)
+        {
+            i++;
+            continue;
+        }
+        // The instruction before now has a new neighbour: look at it again
+        for (size_t back = i; back > 0;)
         {
-            // It's a hex address
-            uint16_t addr;
-            if (addrOrLabel.substr(0, 2) == "0x")
+            if (!statements[--back].removed && !statements[back].op.empty())
             {
-                // Remove 0x prefix
-                std::istringstream hexStream(addrOrLabel.substr(2));
-                hexStream >> std::hex >> addr;
+                i = back;
+                break;
             }
+        }
+    }
+}
+
+// Source text for the statements, one line each
+static void writeStatements(const std::vector<Statement> &statements, std::string &text)
+{
+    text.clear();
+    for (const Statement &statement : statements)
+    {
+        if (!statement.label.empty())
+        {
+            text.append(statement.label);
+            text += ':';
+        }
+        if (!statement.removed && !statement.op.empty())
+        {
+            text += ' ';
+            text.append(statement.op);
+            text += ' ';
+            text.append(statement.operands);
+        }
+        text += '\n';
+    }
+}
+
+// Assemble `text` on the side into `image`, quietly (errors are reported
+// by the real assembly), recording each line's address in `addresses` if
+// given, and build its control-flow graph. False if the graph cannot say
+// which line an address came from, because sections overlap, or if
+// execution does not start in code.
+bool TextAssembler::trialGraph(std::string_view text, std::vector<uint8_t> &image,
+                               std::vector<uint16_t> *addresses, ControlFlowGraph &graph)
+{
+    image.assign(0x10000, 0);
+    std::ostringstream ignored;
+    TextAssembler trial(image.data());
+    trial.errors = &ignored;
+    trial.lineAddresses = addresses;
+    trial.firstPass(text);
+    trial.doSecondPass(text);
+    graph.build(image.data(), trial.sectionList, trial.entryPoint, &trial.symbolTable);
+
+    std::vector<ObjectSection> sections = trial.sectionList;
+    std::sort(sections.begin(), sections.end(), [](const ObjectSection &x, const ObjectSection &y)
+              { return x.addr < y.addr; });
+    for (size_t i = 1; i < sections.size(); i++)
+    {
+        if (sections[i - 1].addr + sections[i - 1].size > sections[i].addr)
+            return false;
+    }
+    return graph.block_at(trial.entryPoint) != nullptr;
+}
+
+// A 16-bit immediate that is where a block of code starts: the program
+// computes where it goes (push the value, then ret), which no graph can
+// follow
+static bool loadsCodeAddress(const ControlFlowGraph &graph, const uint8_t *image, uint16_t &value)
+{
+    for (const BasicBlock &block : graph.blocks())
+    {
+        DecodedInsn d = {};
+        for (uint32_t at = block.start; at < block.end; at += d.len)
+        {
+            decode_bytes(image, at, d);
+            if (d.op == D_LD_A || d.op == D_LD_B || d.op == D_LD_C)
+                value = d.imm;
+            else if (d.op == D_STORE_IMM16)
+                value = d.imm2;
             else
+                continue;
+            const BasicBlock *target = graph.block_at(value);
+            if (target && target->start == value)
+                return true;
+        }
+    }
+    return false;
+}
+
+// Run the rules over `source`, then assemble the result on the side and
+// drop the instructions its control-flow graph cannot reach from the entry
+// point. Returns the optimised text, which lives in optimisedSource. Jumps
+// to numeric addresses, and code addresses loaded as values, would go
+// astray once code moves, so a source with any is returned as it is.
+std::string_view TextAssembler::peephole(std::string_view source)
+{
+    peepholeStats = PeepholeStats();
+    std::vector<Statement> statements;
+    std::map<std::string_view, int> labelCounts;
+    for (std::string_view rest = source; !rest.empty();)
+    {
+        Statement statement = {};
+        std::string_view line = preprocessLine(nextLine(rest));
+        if (isLabelDefinition(line, statement.label))
+            labelCounts[statement.label]++;
+        statement.op = nextToken(line);
+        statement.operands = line;
+        if (isBranch(statement.op) || statement.op == ".entry")
+        {
+            std::string_view target = nextToken(line);
+            if (!target.empty() && std::isdigit((unsigned char)target[0]))
             {
-                // Try to parse as decimal
-                std::istringstream decStream(addrOrLabel);
-                decStream >> addr;
+                std::cerr << "Warning: Not optimising: '" << statement.op << " " << target
+                          << "' jumps to a fixed address" << std::endl;
+                return source;
             }
-            memory[currentAddress++] = (addr >> 8) & 0xFF; // High byte
-            memory[currentAddress++] = addr & 0xFF;        // Low byte
         }
+        statements.push_back(statement);
     }
-    // Memory operations with address
-    else if (opcode == "load_a" || opcode == "store_a" || opcode == "load8_a" ||
-             opcode == "store8_a" || opcode == "load" || opcode == "store")
+
+    std::vector<uint8_t> image;
+    std::vector<uint16_t> addresses;
+    ControlFlowGraph graph;
+    uint16_t value;
+    trialGraph(source, image, nullptr, graph);
+    if (loadsCodeAddress(graph, image.data(), value))
     {
-        uint16_t addr;
-        iss >> std::hex >> addr;
-        memory[currentAddress++] = (addr >> 8) & 0xFF; // High byte
-        memory[currentAddress++] = addr & 0xFF;        // Low byte
+        std::cerr << "Warning: Not optimising: the value 0x" << std::hex << value << std::dec
+                  << " is the address of code" << std::endl;
+        return source;
+    }
+
+    applyPeepholeRules(statements, labelCounts, peepholeStats);
+    writeStatements(statements, optimisedSource);
+    if (!trialGraph(optimisedSource, image, &addresses, graph))
+        return optimisedSource;
 
-        // For LOAD and STORE, we need an additional register operand
-        if (opcode == "load" || opcode == "store")
+    size_t unreachable = 0;
+    for (size_t i = 0; i < statements.size(); i++)
+    {
+        const Mnemonic *mnemonic = findMnemonic(statements[i].op);
+        const BasicBlock *block = mnemonic && !statements[i].removed ? graph.block_at(addresses[i]) : nullptr;
+        if (block && !block->reachable)
         {
-            char reg;
-            iss >> reg;
-            memory[currentAddress++] = reg;
+            statements[i].removed = true;
+            peepholeStats.instructions++;
+            peepholeStats.bytes += mnemonic->size;
+            unreachable++;
         }
     }
-    // Memory move operations with address and immediate value
-    else if (opcode == "mov_mem_imm")
+    if (unreachable)
     {
-        uint16_t addr;
-        iss >> std::hex >> addr;
-        memory[currentAddress++] = (addr >> 8) & 0xFF; // High byte
-        memory[currentAddress++] = addr & 0xFF;        // Low byte
+        peepholeStats.rules["unreachable code"] += unreachable;
+        applyPeepholeRules(statements, labelCounts, peepholeStats);
+        writeStatements(statements, optimisedSource);
+    }
+    return optimisedSource;
+}
 
-        uint16_t value;
-        iss >> value;
-        memory[currentAddress++] = (value >> 8) & 0xFF; // High byte
-        memory[currentAddress++] = value & 0xFF;        // Low byte
+// Complete two-pass assembly
+void TextAssembler::assemble(std::string_view source, unsigned threads)
+{
+    if (optimise)
+        source = peephole(source);
+    threads = std::min<size_t>(threads, source.size() / PARALLEL_MIN_BYTES);
+    if (threads > 1)
+    {
+        assembleParallel(source, threads);
     }
-    // 8-bit memory move with address and immediate value
-    else if (opcode == "mov8_mem_imm")
+    else
     {
-        uint16_t addr;
-        iss >> std::hex >> addr;
-        memory[currentAddress++] = (addr >> 8) & 0xFF; // High byte
-        memory[currentAddress++] = addr & 0xFF;        // Low byte
+        // First pass: build symbol table
+        firstPass(source);
 
-        uint8_t value;
-        iss >> value;
-        memory[currentAddress++] = value; // 8-bit value
+        // Second pass: generate code
+        doSecondPass(source);
     }
-    // Register moves
-    else if (opcode == "mov_reg_imm")
+
+    // Debug output
+    std::cout << "Symbol table after first pass:\n";
+    for (const auto &symbol : symbolTable)
     {
-        char reg;
-        iss >> reg;
-        memory[currentAddress++] = reg;
+        std::cout << symbol.first << " = 0x" << std::hex << symbol.second << "\n";
+    }
+    std::cout << std::dec << std::flush;
+}
+
+// Both passes over `threads` runs of whole lines of about equal size. The first pass sizes each
+// run on its own; a prefix sum over the results then gives every run its
+// start address and the labels their final values. In the second pass each
+// run is encoded by its own TextAssembler into a private image, and the
+// images are copied into memory in source order, so where .org makes runs
+// overlap, later lines still win as they would serially.
+void TextAssembler::assembleParallel(std::string_view source, unsigned threads)
+{
+    std::vector<std::string_view> runs;
+    size_t begin = 0;
+    for (unsigned i = 1; i <= threads; i++)
+    {
+        size_t end = i == threads ? source.size() : source.find('\n', std::max(begin, source.size() * i / threads));
+        end = end == std::string_view::npos ? source.size() : std::min(end + 1, source.size());
+        runs.push_back(source.substr(begin, end - begin));
+        begin = end;
+    }
 
-        uint16_t addr;
-        iss >> std::hex >> addr;
-        memory[currentAddress++] = (addr >> 8) & 0xFF; // High byte
-        memory[currentAddress++] = addr & 0xFF;        // Low byte
+    std::vector<ChunkLayout> layouts(threads);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++)
+        workers.emplace_back([&, i]
+                             { layoutLines(runs[i], layouts[i]); });
+    for (auto &worker : workers)
+        worker.join();
+    workers.clear();
 
-        uint16_t value;
-        iss >> value;
-        memory[currentAddress++] = (value >> 8) & 0xFF; // High byte
-        memory[currentAddress++] = value & 0xFF;        // Low byte
+    isSecondPass = true;
+    symbolTable.clear();
+    std::vector<uint16_t> bases;
+    uint16_t address = 0x9000; // default start address
+    for (const auto &layout : layouts)
+    {
+        bases.push_back(address);
+        address = placeChunk(layout, address);
     }
-    else if (opcode == "mov_reg_reg")
+    layouts.clear();
+
+    std::vector<std::vector<uint8_t>> images(threads);
+    std::vector<std::unique_ptr<TextAssembler>> chunks;
+    for (unsigned i = 0; i < threads; i++)
     {
-        char reg1;
-        iss >> reg1;
-        char reg2;
-        iss >> reg2;
-        memory[currentAddress++] = reg1;
-        memory[currentAddress++] = reg2;
+        images[i].resize(0x10000);
+        chunks.emplace_back(new TextAssembler(images[i].data()));
+        TextAssembler &chunk = *chunks.back();
+        chunk.sharedSymbols = &symbolTable;
+        chunk.isSecondPass = true;
+        chunk.currentAddress = bases[i];
+        workers.emplace_back([&, i]
+                             {
+                                 std::string_view run = runs[i];
+                                 while (!run.empty())
+                                     chunks[i]->parseLine(nextLine(run));
+                             });
     }
-    else if (opcode == "mov_reg_mem" || opcode == "mov_reg_mem2")
+    for (auto &worker : workers)
+        worker.join();
+
+    currentAddress = chunks.back()->currentAddress;
+    entryPoint = 0x9000;
+    sectionList.clear();
+    for (unsigned i = 0; i < threads; i++)
     {
-        char reg;
-        iss >> reg;
-        memory[currentAddress++] = reg;
+        for (const ObjectSection &section : chunks[i]->sectionList)
+        {
+            for (uint32_t offset = 0; offset < section.size; offset++)
+            {
+                uint16_t addr = section.addr + offset;
+                memory[addr] = images[i][addr];
+            }
+            appendSection(section);
+        }
+        if (chunks[i]->entrySet)
+            entryPoint = chunks[i]->entryPoint;
+    }
+}
+
+IncrementalAssembler::IncrementalAssembler(uint8_t *memory)
+    : memory(memory), image(memory), scratch(0x10000), writers(0x10000)
+{
+    image.isSecondPass = true;
+}
+
+std::string_view IncrementalAssembler::lineText(const Line &line) const
+{
+    return std::string_view(text).substr(line.offset, line.length);
+}
+
+// First-pass facts about one line: its label, size and any .org
+void IncrementalAssembler::layout(Line &line)
+{
+    TextAssembler::ChunkLayout chunk;
+    image.layoutLines(lineText(line), chunk);
+    line.label = chunk.labels.empty() ? "" : std::string(chunk.labels[0].first);
+    line.org = chunk.hasOrg;
+    line.orgAddress = chunk.hasOrg ? chunk.end : 0;
+    line.size = chunk.hasOrg ? 0 : chunk.end;
+}
+
+// Encode one line at its address against the current symbol table
+void IncrementalAssembler::encode(Line &line)
+{
+    TextAssembler encoder(scratch.data());
+    encoder.sharedSymbols = &image.symbolTable;
+    encoder.isSecondPass = true;
+    encoder.currentAddress = line.address;
+    encoder.parseLine(lineText(line));
+
+    line.reference = std::string(encoder.referencedLabel);
+    line.entry = encoder.entrySet;
+    line.entryAddress = encoder.entryPoint;
+    line.kind = encoder.sectionList.empty() ? (uint16_t)SECTION_CODE : encoder.sectionList[0].kind;
+    line.bytes.resize(line.size);
+    for (uint16_t i = 0; i < line.size; i++)
+        line.bytes[i] = scratch[(uint16_t)(line.address + i)];
+    line.dirty = true;
+}
 
-        uint16_t addr;
-        iss >> std::hex >> addr;
-        memory[currentAddress++] = (addr >> 8) & 0xFF; // High byte
-        memory[currentAddress++] = addr & 0xFF;        // Low byte
+// Take a line's bytes out of memory, leaving zeroes where no other line
+// covers them
+void IncrementalAssembler::release(Line &line)
+{
+    for (uint16_t i = 0; i < line.size; i++)
+    {
+        uint16_t addr = line.placedAddress + i;
+        if (writers[addr] > 1)
+            overlap = true;
+        if (writers[addr] && --writers[addr] == 0)
+            memory[addr] = 0;
     }
-    else if (opcode == "mov_mem_reg")
+    line.placed = false;
+}
+
+void IncrementalAssembler::claim(Line &line)
+{
+    for (uint16_t i = 0; i < line.size; i++)
     {
-        uint16_t addr;
-        iss >> std::hex >> addr;
-        memory[currentAddress++] = (addr >> 8) & 0xFF; // High byte
-        memory[currentAddress++] = addr & 0xFF;        // Low byte
+        uint16_t addr = line.address + i;
+        if (writers[addr])
+            overlap = true;
+        if (writers[addr] < 0xFF)
+            writers[addr]++;
+        memory[addr] = line.bytes[i];
+    }
+    line.placed = true;
+    line.placedAddress = line.address;
+    line.dirty = false;
+}
 
-        char reg;
-        iss >> reg;
-        memory[currentAddress++] = reg;
+const IncrementalAssembler::Stats &IncrementalAssembler::update(std::string_view source)
+{
+    stats = Stats();
+
+    // The edit lies between the longest common head and tail of the texts
+    size_t limit = std::min(text.size(), source.size());
+    size_t head = std::mismatch(text.begin(), text.begin() + limit, source.begin()).first - text.begin();
+    size_t tail = 0;
+    while (tail < limit - head && text[text.size() - 1 - tail] == source[source.size() - 1 - tail])
+        tail++;
+
+    // Old lines wholly inside the head or tail are kept; the rest go
+    size_t kept = std::partition_point(lines.begin(), lines.end(), [&](const Line &line)
+                                       { return line.offset + line.length < head; }) -
+                  lines.begin();
+    size_t tailStart = std::partition_point(lines.begin() + kept, lines.end(), [&](const Line &line)
+                                            { return line.offset < text.size() - tail + 1; }) -
+                       lines.begin();
+    bool labelsMoved = false;
+    for (size_t i = kept; i < tailStart; i++)
+    {
+        labelsMoved |= !lines[i].label.empty();
+        if (lines[i].placed)
+            release(lines[i]);
+    }
+
+    // Split and lay out the new lines in between
+    std::ptrdiff_t shift = (std::ptrdiff_t)source.size() - (std::ptrdiff_t)text.size();
+    size_t begin = kept ? lines[kept - 1].offset + lines[kept - 1].length + 1 : 0;
+    size_t end = tailStart < lines.size() ? lines[tailStart].offset + shift : source.size();
+    text.assign(source.data(), source.size());
+    std::vector<Line> middle;
+    std::string_view rest = std::string_view(text).substr(begin, end - begin);
+    while (!rest.empty())
+    {
+        std::string_view lineView = nextLine(rest);
+        Line line = {};
+        line.offset = lineView.data() - text.data();
+        line.length = lineView.size();
+        layout(line);
+        labelsMoved |= !line.label.empty();
+        middle.push_back(std::move(line));
     }
-    // Wait cycles instruction
-    else if (opcode == "wait")
+    for (size_t i = tailStart; i < lines.size(); i++)
+        lines[i].offset += shift;
+    lines.erase(lines.begin() + kept, lines.begin() + tailStart);
+    lines.insert(lines.begin() + kept, std::make_move_iterator(middle.begin()), std::make_move_iterator(middle.end()));
+    size_t middleEnd = kept + middle.size();
+
+    // Addresses from the first new line on, until the tail is back in step
+    uint16_t next = kept ? lines[kept - 1].address + lines[kept - 1].size : 0x9000;
+    for (size_t i = kept; i < lines.size(); i++)
     {
-        uint8_t cycles;
-        iss >> cycles;
-        memory[currentAddress++] = cycles;
+        Line &line = lines[i];
+        if (i >= middleEnd && line.start == next)
+            break;
+        labelsMoved |= !line.label.empty();
+        line.start = next;
+        line.address = line.org ? line.orgAddress : next;
+        if (line.placed && line.address != line.placedAddress)
+            line.dirty = true;
+        next = line.address + line.size;
     }
-    // Syscall and interrupt
-    else if (opcode == "syscall")
+
+    // Labels that changed value, and lines whose operand names one of them
+    std::set<std::string, std::less<>> changed;
+    if (labelsMoved)
     {
-        // Syscall number is in register A
+        SymbolTable symbols;
+        for (const Line &line : lines)
+        {
+            if (!line.label.empty())
+                symbols[line.label] = line.start;
+        }
+        for (const auto &symbol : symbols)
+        {
+            auto old = image.symbolTable.find(symbol.first);
+            if (old == image.symbolTable.end() || old->second != symbol.second)
+                changed.insert(symbol.first);
+        }
+        for (const auto &symbol : image.symbolTable)
+        {
+            if (!symbols.count(symbol.first))
+                changed.insert(symbol.first);
+        }
+        image.symbolTable.swap(symbols);
     }
-    else if (opcode == "int")
+    for (size_t i = kept; i < middleEnd; i++)
+        encode(lines[i]);
+    stats.parsed = middle.size();
+    if (!changed.empty())
     {
-        uint8_t int_num;
-        iss >> std::hex >> int_num;
-        memory[currentAddress++] = int_num;
+        for (size_t i = 0; i < lines.size(); i++)
+        {
+            if ((i < kept || i >= middleEnd) && !lines[i].reference.empty() && changed.count(lines[i].reference))
+            {
+                encode(lines[i]);
+                stats.reencoded++;
+            }
+        }
     }
-}
 
-// Assemble multiple lines (second pass)
-void TextAssembler::doSecondPass(const std::vector<std::string> &code)
-{
-    isSecondPass = true;
-    currentAddress = 0x9000; // Reset to default start address
+    // Patch memory: vacate every range that changes, then fill the new ones
+    for (Line &line : lines)
+    {
+        if (line.dirty && line.placed)
+            release(line);
+    }
+    for (Line &line : lines)
+    {
+        if (line.dirty)
+        {
+            claim(line);
+            stats.rewritten++;
+        }
+    }
+    if (overlap)
+    {
+        // Lines share addresses, so a freed byte may belong to another
+        // line: write everything again in source order, later lines winning
+        std::memset(memory, 0, ADDRESS_SPACE);
+        std::fill(writers.begin(), writers.end(), 0);
+        for (Line &line : lines)
+            claim(line);
+        overlap = false;
+        stats.rewritten = lines.size();
+        stats.full = true;
+    }
 
-    for (const auto &line : code)
+    image.sectionList.clear();
+    image.currentAddress = 0x9000;
+    image.entryPoint = 0x9000;
+    for (const Line &line : lines)
     {
-        parseLine(line);
+        image.currentAddress = line.address + line.size;
+        image.noteEmitted(line.address, line.kind);
+        if (line.entry)
+            image.entryPoint = line.entryAddress;
     }
+    stats.lines = lines.size();
+    return stats;
 }
 
-// Complete two-pass assembly
-void TextAssembler::assemble(const std::vector<std::string> &code)
+SourceFile::~SourceFile()
 {
-    // First pass: build symbol table
-    firstPass(code);
-
-    // Second pass: generate code
-    doSecondPass(code);
+    if (mapped)
+        munmap((void *)data, size);
 }
 
-// Load program from file
-std::vector<std::string> TextAssembler::loadFromFile(const std::string &filename)
+bool SourceFile::open(const std::string &filename)
 {
-    std::vector<std::string> code;
-    std::ifstream file(filename);
-
-    if (!file.is_open())
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
     {
         std::cerr << "Error: Could not open file " << filename << std::endl;
-        return code;
+        return false;
     }
 
-    std::string line;
-    while (std::getline(file, line))
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
     {
-        code.push_back(line);
+        size = st.st_size;
+        void *p = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        if (p != MAP_FAILED)
+        {
+            // Each pass reads the text once, front to back
+            madvise(p, size, MADV_SEQUENTIAL);
+            data = (const char *)p;
+            mapped = true;
+            close(fd);
+            return true;
+        }
     }
 
-    file.close();
-    return code;
+    // Not a mappable file: read it all
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+    {
+        if (n > 0)
+            contents.append(buf, n);
+    }
+    close(fd);
+    if (n < 0)
+    {
+        std::cerr << "Error: Could not read file " << filename << std::endl;
+        return false;
+    }
+    data = contents.data();
+    size = contents.size();
+    return true;
 }
 
 // Save assembled program to file
@@ -427,6 +1339,11 @@ bool TextAssembler::saveToFile(const std::string &filename, uint16_t start, uint
     return true;
 }
 
+bool TextAssembler::saveObject(const std::string &filename)
+{
+    return write_object(filename, memory, sectionList, entryPoint, symbolTable);
+}
+
 // Print a hex dump of the assembled code
 void TextAssembler::hexDump(uint16_t start, uint16_t end, int bytesPerLine)
 {
@@ -455,6 +1372,16 @@ void TextAssembler::hexDump(uint16_t start, uint16_t end, int bytesPerLine)
     }
 }
 
+std::string TextAssembler::mnemonic(uint8_t opcode) const
+{
+    for (const auto &entry : mnemonics)
+    {
+        if (entry.opcode == opcode)
+            return std::string(entry.name);
+    }
+    return "";
+}
+
 // int main(int argc, char **argv)
 
 // {
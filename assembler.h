@@ -2,178 +2,212 @@
 #define ASSEMBLER_HPP
 
 #include "setup.h"
+#include "object.h"
 #include <vector>
 #include <string>
-#include <sstream>
+#include <string_view>
 #include <map>
 #include <fstream>
 #include <iostream>
 #include <cctype>
+#include <cstdlib>
 #include <algorithm>
 
 #include <iomanip> // for std::setw and std::setfill
 
+// Assembly source, read through a read-only mapping of the file so the
+// text is never copied. The passes find lines by scanning for '\n' as they
+// go and keep nothing per line.
+class ControlFlowGraph;
+
+class SourceFile
+{
+public:
+    SourceFile() = default;
+    ~SourceFile();
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    // Reports on stderr and returns false if the file cannot be read
+    bool open(const std::string &filename);
+    std::string_view text() const { return std::string_view(data, size); }
+
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::string contents; // input that cannot be mapped, such as a pipe
+};
+
+// What the peephole pass removed
+struct PeepholeStats
+{
+    size_t instructions = 0;
+    size_t bytes = 0;
+    std::map<std::string, size_t> rules; // rule name -> times it fired
+};
+
 class TextAssembler
 {
 private:
+    // Guest memory the program is assembled into
+    uint8_t *memory;
+
     // Symbol table for labels
-    std::map<std::string, uint16_t> symbolTable;
-
-    // Forward references to be resolved in second pass
-    std::vector<std::pair<uint16_t, std::string>> forwardRefs;
-
-    // Instruction size lookup table (bytes including opcode and operands)
-    std::map<std::string, uint8_t> instructionSize = {
-        // No operand instructions - 1 byte
-        {"nop", 1},
-        {"add", 1},
-        {"sub", 1},
-        {"mul", 1},
-        {"div", 1},
-        {"mod", 1},
-        {"and", 1},
-        {"or", 1},
-        {"xor", 1},
-        {"not", 1},
-        {"shl", 1},
-        {"shr", 1},
-        {"printa", 1},
-        {"printc", 1},
-        {"ina", 1},
-        {"ret", 1},
-        {"halt", 1},
-        {"reset", 1},
-        {"push_a", 1},
-        {"pop_a", 1},
-        {"push_b", 1},
-        {"pop_b", 1},
-        {"cmp", 1},
-
-        // Register + immediate value - 3 bytes (opcode + 16-bit value)
-        {"lda", 3},
-        {"ldb", 3},
-        {"ldc", 3},
-
-        // Single register instructions - 2 bytes (opcode + register)
-        {"inc", 2},
-
-        // Jump instructions - 3 bytes (opcode + address)
-        {"jmp", 3},
-        {"jz", 3},
-        {"jnz", 3},
-        {"jn", 3},
-        {"jp", 3},
-        {"jeq", 3},
-        {"jgt", 3},
-        {"jlt", 3},
-        {"call", 3},
-
-        // Memory operations with address - 3 bytes
-        {"load_a", 3},
-        {"store_a", 3},
-        {"load8_a", 3},
-        {"store8_a", 3},
-
-        {"mov8_mem_imm", 4}, // memory[addr] = immediate 8-bit
-        {"mov_reg_imm", 4},  // reg = immediate 16-bit
-        {"mov_reg_reg", 3},  // reg1 = reg2
-        {"mov_reg_mem", 4},  // reg = memory[addr] (8-bit)
-        {"mov_reg_mem2", 4}, // reg = memory[addr] | (memory[addr+1] << 8) (16-bit)
-        {"mov_mem_reg", 4},  // memory[addr] = reg (16-bit)
-        {"mov_mem_imm", 5},  // memory[addr] = immediate 16-bit
-        {"load", 4},         // reg = memory[addr]
-        {"store", 4},        // memory[addr] = reg
-
-        // Wait cycles - variable size
-        {"wait", 2},
-
-        // Syscall - variable size
-        {"syscall", 1},
-
-        // Interrupt - variable size
-        {"int", 2}};
-
-    std::map<std::string, uint8_t> opcodeMap = {
-        // Basic Arithmetic & Logic
-        {"nop", NOP},     // No operation
-        {"lda", LDA_IMM}, // A = immediate 16-bit
-        {"ldb", LDB_IMM}, // B = immediate 16-bit
-        {"ldc", LDC_IMM}, // C = immediate 16-bit
-        {"add", ADD},     // A = A + B
-        {"sub", SUB},     // A = A - B
-        {"mul", MUL},     // A = A * B
-        {"div", DIV},     // A = A / B (if B != 0)
-        {"mod", MOD},     // A = A % B (if B != 0)
-        {"and", AND},     // A = A & B
-        {"or", OR},       // A = A | B
-        {"xor", XOR},     // A = A ^ B
-        {"not", NOT},     // A = ~A
-        {"shl", SHL},     // A = A << 1
-        {"shr", SHR},     // A = A >> 1
-        {"inc", INC},     // Increment register by 1
-
-        // I/O Operations
-        {"printa", PRINT_A},    // Print A register as number
-        {"printc", PRINT_CHAR}, // Print A register as ASCII char
-        {"ina", IN_A},          // A = getchar() (input)
-
-        // Memory Operations
-        {"load_a", LOAD_A_MEM},         // A = memory[addr] (16-bit)
-        {"store_a", STORE_A_MEM},       // memory[addr] = A (16-bit)
-        {"load8_a", LOAD8_A_MEM},       // A = memory[addr] (8-bit)
-        {"store8_a", STORE8_A_MEM},     // memory[addr] = A & 0xFF (8-bit)
-        {"mov_mem_imm", MOV_MEM_IMM},   // memory[addr] = immediate 16-bit
-        {"mov8_mem_imm", MOV8_MEM_IMM}, // memory[addr] = immediate 8-bit
-        {"mov_reg_imm", MOV_REG_IMM},   // reg = immediate 16-bit
-        {"mov_reg_reg", MOV_REG_REG},   // reg1 = reg2
-        {"mov_reg_mem", MOV_REG_MEM},   // reg = memory[addr] (8-bit)
-        {"mov_reg_mem2", MOV_REG_MEM2}, // reg = memory[addr] | (memory[addr+1] << 8) (16-bit)
-        {"mov_mem_reg", MOV_MEM_REG},   // memory[addr] = reg (16-bit)
-        {"load", LOAD},                 // reg = memory[addr]
-        {"store", STORE},               // memory[addr] = reg
-
-        // Control Flow
-        {"jmp", JMP},   // Jump to addr
-        {"jz", JZ},     // Jump if zero flag
-        {"jnz", JNZ},   // Jump if not zero flag
-        {"jn", JN},     // Jump if negative flag
-        {"jp", JP},     // Jump if positive (not negative and not zero)
-        {"jeq", JEQ},   // Jump if B == C
-        {"jgt", JGT},   // Jump if B > C
-        {"jlt", JLT},   // Jump if B < C
-        {"call", CALL}, // Push PC to stack and jump to addr
-        {"ret", RET},   // Pop PC from stack
-
-        // Stack Operations
-        {"push_a", PUSH_A}, // Push A to stack
-        {"pop_a", POP_A},   // Pop from stack into A
-        {"push_b", PUSH_B}, // Push B to stack
-        {"pop_b", POP_B},   // Pop from stack into B
-
-        // Comparison
-        {"cmp", CMP}, // Compare B and C, set flags
-
-        // System & Misc
-        {"wait", WAIT},       // Wait N cycles
-        {"syscall", SYSCALL}, // System call (A = call number)
-        {"int", INT},         // Interrupt (parameter = interrupt number)
-        {"reset", RESET},     // Reset CPU state
-        {"halt", HALT}        // Halt execution
-    };
+    SymbolTable symbolTable;
+    // Set on the per-chunk assemblers of a parallel second pass: the table
+    // of the assembler that owns them, used instead of their own
+    const SymbolTable *sharedSymbols = nullptr;
+
     uint16_t currentAddress = 0x9000;
     bool isSecondPass = false;
 
-    std::string preprocessLine(const std::string &line);
-    bool isLabelDefinition(const std::string &line, std::string &label);
+    // Where execution starts, set with .entry
+    uint16_t entryPoint = 0x9000;
+    bool entrySet = false;
+
+    // Where parse errors are reported
+    std::ostream *errors = &std::cerr;
+    // When set, the second pass appends the address of each line to it
+    std::vector<uint16_t> *lineAddresses = nullptr;
+
+    // Label named by the last jump or .entry operand
+    std::string_view referencedLabel;
+
+    // Run the peephole pass before assembling; the source it produced
+    bool optimise = false;
+    std::string optimisedSource;
+    PeepholeStats peepholeStats;
+
+    // Memory written by the second pass, in emission order
+    std::vector<ObjectSection> sectionList;
+
+    // First-pass result for a run of lines. Until the first .org, addresses
+    // are offsets from wherever the run turns out to start.
+    struct ChunkLayout
+    {
+        std::vector<std::pair<std::string_view, uint16_t>> labels; // in source order
+        size_t relativeLabels = 0; // how many leading labels are offsets
+        bool hasOrg = false;
+        uint16_t end = 0; // address after the run; an offset unless hasOrg
+    };
+
+    void layoutLines(std::string_view source, ChunkLayout &layout);
+    uint16_t placeChunk(const ChunkLayout &layout, uint16_t base);
+    void assembleParallel(std::string_view source, unsigned threads);
+    void appendSection(const ObjectSection &section);
+    std::string_view preprocessLine(std::string_view line);
+    bool isLabelDefinition(std::string_view &line, std::string_view &label);
+    std::vector<uint8_t> parseDataBytes(std::string_view operands);
+    void noteEmitted(uint16_t start, uint16_t kind);
+
+    // Operand readers for the second pass; each takes the next token off
+    // `operands` and reports a missing or malformed one on stderr
+    uint8_t readRegister(std::string_view &operands);
+    uint8_t readVectorRegister(std::string_view &operands);
+    uint16_t readNumber(std::string_view &operands, int base, uint32_t max = 0xFFFF);
+    uint16_t readTarget(std::string_view &operands);
+    void emit16(uint16_t value);
+
+    std::string_view peephole(std::string_view source);
+    bool trialGraph(std::string_view text, std::vector<uint8_t> &image, std::vector<uint16_t> *addresses,
+                    ControlFlowGraph &graph);
+
+    friend class IncrementalAssembler;
 
 public:
-    void firstPass(const std::vector<std::string> &code);
-    void doSecondPass(const std::vector<std::string> &code);
-    void assemble(const std::vector<std::string> &code);
-    void parseLine(const std::string &rawLine);
-    std::vector<std::string> loadFromFile(const std::string &filename);
+    explicit TextAssembler(uint8_t *memory) : memory(memory) {}
+
+    void firstPass(std::string_view source);
+    void doSecondPass(std::string_view source);
+    // Two-pass assembly. With threads > 1, large sources are split into
+    // chunks that are sized and then encoded in parallel; the result is
+    // identical to assembling serially.
+    void assemble(std::string_view source, unsigned threads = 1);
+    // Drop wasted instructions (see peepholeRules) and code that cannot be
+    // reached before assemble() lays the program out, so labels get their
+    // addresses in the shrunk code
+    void setOptimise(bool on) { optimise = on; }
+    const PeepholeStats &optimised() const { return peepholeStats; }
+    void parseLine(std::string_view rawLine);
     bool saveToFile(const std::string &filename, uint16_t start, uint16_t end);
+    // Write the program as an object file (see object.h) with its sections,
+    // entry point and symbol table
+    bool saveObject(const std::string &filename);
     void hexDump(uint16_t start, uint16_t end, int bytesPerLine = 16);
+
+    // Labels and their addresses, complete after the first pass
+    const SymbolTable &symbols() const { return symbolTable; }
+    void defineSymbol(const std::string &name, uint16_t addr) { symbolTable[name] = addr; }
+    // Code and data runs emitted by the second pass
+    const std::vector<ObjectSection> &sections() const { return sectionList; }
+    uint16_t entry() const { return entryPoint; }
+    // Mnemonic for an opcode byte, or "" if the assembler has none
+    std::string mnemonic(uint8_t opcode) const;
+};
+
+// Reassembles a source that is edited a little at a time (watch mode).
+// Each line's layout and encoded bytes are cached. update() compares the
+// new text with the previous one and parses only the lines between their
+// common head and tail. Lines whose label operand changed value are
+// encoded again, and memory is rewritten only where lines changed or moved.
+class IncrementalAssembler
+{
+public:
+    // Assembles into `memory`, which must be zeroed to begin with
+    explicit IncrementalAssembler(uint8_t *memory);
+
+    // What the last update() did
+    struct Stats
+    {
+        size_t lines = 0;     // lines in the source
+        size_t parsed = 0;    // lines laid out and encoded from their text
+        size_t reencoded = 0; // unchanged lines encoded again for a moved label
+        size_t rewritten = 0; // lines whose bytes were written to memory
+        bool full = false;    // overlapping .org ranges forced a full rewrite
+    };
+
+    // Make memory, symbols, sections and entry point match `source`
+    const Stats &update(std::string_view source);
+
+    // The assembled program, for saveToFile(), saveObject() and friends
+    TextAssembler &program() { return image; }
+
+private:
+    struct Line
+    {
+        uint32_t offset; // in `text`
+        uint32_t length;
+        uint16_t start;   // address counter before the line; its label's value
+        uint16_t address; // where its bytes go: start, or the .org address
+        uint16_t size;
+        uint16_t kind;    // SectionKind of its bytes
+        bool org;
+        uint16_t orgAddress;
+        bool entry; // an .entry line, pointing at entryAddress
+        uint16_t entryAddress;
+        bool placed; // its bytes are in memory at placedAddress
+        bool dirty;  // its bytes need writing at address
+        uint16_t placedAddress;
+        std::string label;     // defined on this line, or ""
+        std::string reference; // label its operand names, or ""
+        std::vector<uint8_t> bytes;
+    };
+
+    std::string_view lineText(const Line &line) const;
+    void layout(Line &line);
+    void encode(Line &line);
+    void release(Line &line);
+    void claim(Line &line);
+
+    uint8_t *memory;
+    TextAssembler image;      // memory, symbol table, sections, entry point
+    std::vector<uint8_t> scratch; // encoding target for single lines
+    std::vector<uint8_t> writers; // per address: placed lines covering it (saturating)
+    bool overlap = false;
+    std::string text; // source of the cached lines
+    std::vector<Line> lines;
+    Stats stats;
 };
 
-#endif // ASSEMBLER_HPP
\ No newline at end of file
+#endif // ASSEMBLER_HPP
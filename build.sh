@@ -2,14 +2,26 @@
 
 # Compile the vm runtime with all source files
 echo "Compiling vm runtime..."
-g++ -o vm run.cpp setup.cpp cpu.cpp assembler.cpp -std=c++11
+g++ -o vm run.cpp cpu.cpp decode.cpp jit.cpp profile.cpp object.cpp cfg.cpp aot.cpp assembler.cpp -std=c++17 -O2 -pthread
 
 # Check if compilation was successful
 if [ $? -eq 0 ]; then
     echo "Compilation successful!"
-    echo "Usage: ./vm <input.asm> [-r] [output.bin]"
+    echo "Usage: ./vm <input.asm> [-r] [-b addr] [-e addr] [-d mode] [-s bytes] [-m banks] [-p file] [-t clock] [-j threads] [-n count] [-w] [-O] [-a file.cpp] [output.bin]"
     echo "  -r         : Run the program after assembling"
-    echo "  output.bin : Save assembled binary to file (optional)"
+    echo "  -b addr    : Input is a binary image; load it at addr and run it"
+    echo "  -e addr    : Entry point of a binary image (default: its load address)"
+    echo "  -d mode    : Execution engine: 'switch' (default), 'threaded' or 'jit'"
+    echo "  -s bytes   : Stack size, even (default 0x400)"
+    echo "  -m banks   : Number of 16 KB memory banks the guest can map at 0x4000 (default 1)"
+    echo "  -p file    : Profile the run (switch loop); report to file, stacks to file.folded"
+    echo "  -t clock   : 'real' waits sleep (default), 'virtual' waits only advance the clock"
+    echo "  -j threads : Assemble large sources on this many threads (default 1)"
+    echo "  -n count   : Run count instances of the program from one shared image; report memory per instance"
+    echo "  -w         : Watch the source; reassemble (and rerun) only what changed on each save"
+    echo "  -O         : Remove wasted and unreachable instructions before assembling"
+    echo "  -a file    : Translate the program to a standalone C++ file instead of running it"
+    echo "  output.bin : Save assembled binary to file (optional); a .hxo name writes an object file"
 else
     echo "Compilation failed."
 fi
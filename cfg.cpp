@@ -0,0 +1,144 @@
+#include "cfg.h"
+#include "decode.h"
+#include <algorithm>
+
+static bool has_target(const DecodedInsn &d)
+{
+    switch (d.op)
+    {
+    case D_JMP:
+    case D_JZ:
+    case D_JNZ:
+    case D_JN:
+    case D_JP:
+    case D_JEQ:
+    case D_JGT:
+    case D_JLT:
+    case D_CALL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Instructions that restart the program at its entry point
+static bool restarts(const DecodedInsn &d)
+{
+    return d.op == D_RESET || (d.op == D_INT && d.imm == 0x13);
+}
+
+static bool falls_through(const DecodedInsn &d)
+{
+    return d.op != D_JMP && d.op != D_RET && d.op != D_HALT && d.op != D_ILLEGAL && !restarts(d);
+}
+
+static bool ends_block(const DecodedInsn &d)
+{
+    return has_target(d) || !falls_through(d);
+}
+
+void ControlFlowGraph::build(const uint8_t *memory, const std::vector<ObjectSection> &sections, uint16_t entry,
+                             const SymbolTable *symbols)
+{
+    blockList.clear();
+
+    // Sweep the code sections for instructions and where blocks must start
+    std::vector<uint8_t> length(0x10000, 0); // of the instruction at each address
+    std::vector<bool> leader(0x10000, false);
+    leader[entry] = true;
+    for (const ObjectSection &section : sections)
+    {
+        if (section.kind != SECTION_CODE)
+            continue;
+        leader[section.addr] = true;
+        uint32_t end = section.addr + section.size;
+        for (uint32_t pc = section.addr; pc < end;)
+        {
+            DecodedInsn d;
+            decode_bytes(memory, pc, d);
+            if (pc + d.len > end)
+                break;
+            length[pc] = d.len;
+            if (ends_block(d) && pc + d.len < 0x10000)
+                leader[pc + d.len] = true;
+            if (has_target(d))
+                leader[d.imm] = true;
+            pc += d.len;
+        }
+    }
+    if (symbols)
+    {
+        for (const auto &symbol : *symbols)
+            leader[symbol.second] = true;
+    }
+
+    // Cut the instructions into blocks, remembering each block's last one
+    std::vector<uint16_t> last;
+    for (uint32_t pc = 0; pc < 0x10000; pc++)
+    {
+        if (!length[pc])
+            continue;
+        if (blockList.empty() || leader[pc] || blockList.back().end != pc)
+        {
+            blockList.push_back(BasicBlock{(uint16_t)pc, pc, {}, false});
+            last.push_back(pc);
+        }
+        blockList.back().end = pc + length[pc];
+        last.back() = pc;
+        pc += length[pc] - 1; // a second section may overlap this one off step
+    }
+
+    for (size_t i = 0; i < blockList.size(); i++)
+    {
+        BasicBlock &block = blockList[i];
+        DecodedInsn d;
+        decode_bytes(memory, last[i], d);
+        if (falls_through(d) && block.end < 0x10000 && length[block.end])
+            block.successors.push_back(block.end);
+        if (has_target(d))
+            block.successors.push_back(d.imm);
+        if (restarts(d))
+            block.successors.push_back(entry);
+    }
+
+    // Reachability; a branch into the middle of a block reaches all of it
+    std::vector<BasicBlock *> pending;
+    auto visit = [&](uint16_t addr)
+    {
+        BasicBlock *block = const_cast<BasicBlock *>(block_at(addr));
+        if (block && !block->reachable)
+        {
+            block->reachable = true;
+            pending.push_back(block);
+        }
+    };
+    visit(entry);
+    while (!pending.empty())
+    {
+        BasicBlock *block = pending.back();
+        pending.pop_back();
+        for (uint16_t successor : block->successors)
+            visit(successor);
+    }
+}
+
+const BasicBlock *ControlFlowGraph::block_at(uint16_t addr) const
+{
+    auto it = std::upper_bound(blockList.begin(), blockList.end(), addr,
+                               [](uint16_t a, const BasicBlock &block)
+                               { return a < block.start; });
+    if (it == blockList.begin() || addr >= (it - 1)->end)
+        return nullptr;
+    return &*(it - 1);
+}
+
+size_t ControlFlowGraph::unreachable_bytes() const
+{
+    size_t bytes = 0;
+    for (const BasicBlock &block : blockList)
+    {
+        if (!block.reachable)
+            bytes += block.end - block.start;
+    }
+    return bytes;
+}
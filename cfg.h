@@ -0,0 +1,45 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "setup.h"
+#include "object.h"
+#include <vector>
+
+// Straight-line run of instructions, entered only at the top. Control
+// leaves from its last instruction to the blocks in `successors`.
+struct BasicBlock
+{
+    uint16_t start;
+    uint32_t end; // one past its last byte
+    std::vector<uint16_t> successors; // start addresses, fall-through first
+    bool reachable;                   // from the entry point
+};
+
+// Control-flow graph of a program's code, found by decoding its code
+// sections with the VM's own decoder. Blocks start at the entry point,
+// at branch and call targets, at labels and after every branch, so a
+// profiler or translator can use them as its unit of code. Calls have two
+// successors, their target and the instruction after them; a return has
+// none.
+class ControlFlowGraph
+{
+public:
+    // Decode the SECTION_CODE runs of `sections` in `memory` and mark what
+    // is reachable from `entry`. Labels in `symbols`, if given, start blocks.
+    void build(const uint8_t *memory, const std::vector<ObjectSection> &sections, uint16_t entry,
+               const SymbolTable *symbols = nullptr);
+
+    // In address order
+    const std::vector<BasicBlock> &blocks() const { return blockList; }
+
+    // The block holding the byte at addr, or nullptr if it is not code
+    const BasicBlock *block_at(uint16_t addr) const;
+
+    // Bytes of code in blocks that cannot be reached
+    size_t unreachable_bytes() const;
+
+private:
+    std::vector<BasicBlock> blockList;
+};
+
+#endif // CFG_H
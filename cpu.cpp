@@ -1,32 +1,612 @@
 #include "cpu.h"
+#include "jit.h"
+#include "profile.h"
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-CPU cpu;
+// Vector instructions on a register's lanes. On hosts with SSE2 (all of
+// x86-64) a register is one 128-bit value and each operation a few
+// instructions; elsewhere the lanes are done one at a time. Unsigned lane
+// compares go through the signed SSE2 ones with the top bit flipped.
+#if defined(__SSE2__)
+static inline __m128i vector_get(const uint16_t *v)
+{
+    return _mm_load_si128((const __m128i *)v);
+}
+
+static inline void vector_put(uint16_t *v, __m128i value)
+{
+    _mm_store_si128((__m128i *)v, value);
+}
+#endif
+
+// Every lane of `v` = value
+static inline void vector_splat(uint16_t *v, uint16_t value)
+{
+#if defined(__SSE2__)
+    vector_put(v, _mm_set1_epi16(value));
+#else
+    for (int i = 0; i < VECTOR_LANES; i++)
+        v[i] = value;
+#endif
+}
+
+// VADD to VCMPGT: x = x op y, lane by lane
+template <uint8_t OP>
+static inline void vector_lanes(uint16_t *x, const uint16_t *y)
+{
+#if defined(__SSE2__)
+    __m128i p = vector_get(x), q = vector_get(y);
+    const __m128i top = _mm_set1_epi16((short)0x8000);
+    if constexpr (OP == VADD)
+        p = _mm_add_epi16(p, q);
+    else if constexpr (OP == VSUB)
+        p = _mm_sub_epi16(p, q);
+    else if constexpr (OP == VAND)
+        p = _mm_and_si128(p, q);
+    else if constexpr (OP == VOR)
+        p = _mm_or_si128(p, q);
+    else if constexpr (OP == VXOR)
+        p = _mm_xor_si128(p, q);
+    else if constexpr (OP == VCMPEQ)
+        p = _mm_cmpeq_epi16(p, q);
+    else
+        p = _mm_cmpgt_epi16(_mm_xor_si128(p, top), _mm_xor_si128(q, top));
+    vector_put(x, p);
+#else
+    for (int i = 0; i < VECTOR_LANES; i++)
+    {
+        if constexpr (OP == VADD)
+            x[i] += y[i];
+        else if constexpr (OP == VSUB)
+            x[i] -= y[i];
+        else if constexpr (OP == VAND)
+            x[i] &= y[i];
+        else if constexpr (OP == VOR)
+            x[i] |= y[i];
+        else if constexpr (OP == VXOR)
+            x[i] ^= y[i];
+        else if constexpr (OP == VCMPEQ)
+            x[i] = x[i] == y[i] ? 0xFFFF : 0;
+        else
+            x[i] = x[i] > y[i] ? 0xFFFF : 0;
+    }
+#endif
+}
+
+// VSUM, VMIN and VMAX: the lanes of `v` folded into one value
+template <uint8_t OP>
+static inline uint16_t vector_reduce(const uint16_t *v)
+{
+#if defined(__SSE2__)
+    // Halve the width three times; lane 0 ends up holding the answer
+    const __m128i top = _mm_set1_epi16((short)0x8000);
+    __m128i p = vector_get(v);
+    auto fold = [&](__m128i q)
+    {
+        if constexpr (OP == VSUM)
+            return _mm_add_epi16(p, q);
+        else if constexpr (OP == VMIN)
+            return _mm_min_epi16(p, q);
+        else
+            return _mm_max_epi16(p, q);
+    };
+    if constexpr (OP != VSUM)
+        p = _mm_xor_si128(p, top);
+    p = fold(_mm_shuffle_epi32(p, _MM_SHUFFLE(1, 0, 3, 2)));
+    p = fold(_mm_shuffle_epi32(p, _MM_SHUFFLE(2, 3, 0, 1)));
+    p = fold(_mm_srli_epi32(p, 16));
+    if constexpr (OP != VSUM)
+        p = _mm_xor_si128(p, top);
+    return _mm_cvtsi128_si32(p);
+#else
+    uint16_t result = v[0];
+    for (int i = 1; i < VECTOR_LANES; i++)
+    {
+        if constexpr (OP == VSUM)
+            result += v[i];
+        else if constexpr (OP == VMIN)
+            result = std::min(result, v[i]);
+        else
+            result = std::max(result, v[i]);
+    }
+    return result;
+#endif
+}
 
-bool cpu_running = 1;
+// Anonymous mappings are zero-filled by the kernel on first touch, so an
+// idle instance only pays for the pages its guest actually uses
+static void *map_zeroed(size_t size)
+{
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::bad_alloc();
+    return p;
+}
+
+// Guest memory is a shared mapping of a memfd: the address space at file
+// offset 0, bank n >= 1 at ADDRESS_SPACE + (n - 1) * BANK_SIZE. Pages of
+// the file are allocated on first write, so unused banks cost nothing.
+// One more host page after the address space maps the file's first page
+// again, the wrap of a 16-bit access at 0xFFFF.
+static size_t memory_span()
+{
+    return ADDRESS_SPACE + sysconf(_SC_PAGESIZE);
+}
 
-void wait_cycles(uint8_t cycles)
+static off_t bank_offset(uint16_t number)
 {
-    // Simulate waiting for a number of cycles
-    auto start = std::chrono::high_resolution_clock::now();
+    return number == 0 ? BANK_WINDOW : ADDRESS_SPACE + (off_t)(number - 1) * BANK_SIZE;
+}
+
+VM::VM()
+{
+    memory_fd = memfd_create("hexavm", MFD_CLOEXEC);
+    if (memory_fd < 0 || ftruncate(memory_fd, ADDRESS_SPACE) != 0)
+        throw std::bad_alloc();
+    memory = (uint8_t *)mmap(nullptr, memory_span(), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED ||
+        mmap(memory, ADDRESS_SPACE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memory_fd, 0) == MAP_FAILED ||
+        mmap(memory + ADDRESS_SPACE, memory_span() - ADDRESS_SPACE, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, memory_fd, 0) == MAP_FAILED)
+        throw std::bad_alloc();
+    decode_cache = (DecodedInsn *)map_zeroed((0x10000 + DECODE_MAX_SPAN) * sizeof(DecodedInsn));
+    std::memset(page_flags, 0, sizeof(page_flags));
+    cpu.pc = instruction_base;
+    cpu.sp = stack_top;
+}
+
+// Saved by VM::snapshot(). `memory` is a full copy; the pages the guest
+// stored to since are listed in `dirty`, in the order first touched.
+struct Snapshot
+{
+    uint8_t *memory;
+    CPU cpu;
+    bool cpu_running;
+    uint64_t cycles;
+    RunStatus status;
+    uint16_t bank;
+    uint8_t dirty[VM_PAGE_COUNT];
+    int dirty_count;
+};
+
+VM::~VM()
+{
+    if (snap)
+    {
+        munmap(snap->memory, ADDRESS_SPACE);
+        delete snap;
+    }
+    jit_destroy(jit);
+    if (staging)
+        munmap(staging, ADDRESS_SPACE);
+    munmap(decode_cache, (0x10000 + DECODE_MAX_SPAN) * sizeof(DecodedInsn));
+    munmap(memory, memory_span());
+    close(memory_fd);
+}
+
+bool VM::set_banks(uint32_t count)
+{
+    if (count < 1 || count > BANK_MAX || bank >= count)
+    {
+        std::cerr << "Error: Bank count must be between " << bank + 1 << " and " << BANK_MAX << std::endl;
+        return false;
+    }
+    if (ftruncate(memory_fd, ADDRESS_SPACE + (off_t)(count - 1) * BANK_SIZE) != 0)
+    {
+        std::cerr << "Error: Could not reserve " << count << " memory banks" << std::endl;
+        return false;
+    }
+    bank_count = count;
+    return true;
+}
+
+// Reset memory to all zeros
+void VM::clearMemory()
+{
+    std::memset(memory, 0, ADDRESS_SPACE);
+}
+
+// Put bank `number` in the window. Code cached from the window was decoded
+// from the bank going out.
+void VM::map_bank(uint16_t number)
+{
+    if (number == bank)
+        return;
+    if (mmap(memory + BANK_WINDOW, BANK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memory_fd,
+             bank_offset(number)) == MAP_FAILED)
+        throw std::bad_alloc();
+    bank = number;
+    for (int page = BANK_WINDOW >> VM_PAGE_SHIFT; page < (BANK_WINDOW + BANK_SIZE) >> VM_PAGE_SHIFT; page++)
+    {
+        if (page_flags[page] & (PAGE_DECODED | PAGE_JIT))
+            invalidate_page(*this, page);
+    }
+}
+
+// BANK: faults on a bank the VM was not given
+bool VM::select_bank(uint16_t number)
+{
+    if (number >= bank_count)
+    {
+        fault() << "Bank out of range: " << number << std::endl;
+        return false;
+    }
+    map_bank(number);
+    return true;
+}
+
+bool VM::load_image(const std::string &path, uint16_t addr)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Error: Could not open image " << path << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || addr + st.st_size > ADDRESS_SPACE)
+    {
+        std::cerr << "Error: Image " << path << " is empty or does not fit in memory at 0x"
+                  << std::hex << addr << std::dec << std::endl;
+        close(fd);
+        return false;
+    }
+    bool ok = load_region(fd, 0, st.st_size, addr);
+    close(fd);
+    if (!ok)
+        std::cerr << "Error: Could not read image " << path << std::endl;
+    return ok;
+}
+
+bool VM::load_region(int fd, off_t offset, size_t size, uint16_t addr)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    if (size == 0)
+        return true;
+    bool shared = addr < page || (addr < BANK_WINDOW + BANK_SIZE && addr + size > BANK_WINDOW);
+    if (addr % page == 0 && offset % page == 0 && !shared)
+        return mmap(memory + addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) != MAP_FAILED;
+
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pread(fd, memory + addr + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+SharedImage::SharedImage(const VM &vm, const std::vector<ObjectSection> &sections) : entry(vm.instruction_base)
+{
+    uint32_t page = sysconf(_SC_PAGESIZE);
+    for (const ObjectSection &section : sections)
+    {
+        if (section.size == 0)
+            continue;
+        uint32_t start = section.addr & ~(page - 1);
+        uint32_t end = std::min<uint32_t>((section.addr + section.size + page - 1) & ~(page - 1), ADDRESS_SPACE);
+        runs.push_back(std::make_pair(start, end));
+    }
+    std::sort(runs.begin(), runs.end());
+    size_t merged = 0;
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        if (merged && runs[i].first <= runs[merged - 1].second)
+            runs[merged - 1].second = std::max(runs[merged - 1].second, runs[i].second);
+        else
+            runs[merged++] = runs[i];
+    }
+    runs.resize(merged);
+
+    fd = memfd_create("hexavm-image", MFD_CLOEXEC);
+    if (fd < 0)
+        throw std::bad_alloc();
+    bool ok = ftruncate(fd, ADDRESS_SPACE) == 0;
+    for (size_t i = 0; i < runs.size() && ok; i++)
+    {
+        size_t size = runs[i].second - runs[i].first;
+        ok = pwrite(fd, vm.memory + runs[i].first, size, runs[i].first) == (ssize_t)size;
+    }
+    if (!ok)
+    {
+        close(fd);
+        throw std::bad_alloc();
+    }
+}
+
+SharedImage::~SharedImage()
+{
+    close(fd);
+}
+
+bool VM::map_image(const SharedImage &image)
+{
+    for (const auto &run : image.runs)
+    {
+        if (!load_region(image.fd, run.first, run.second - run.first, run.first))
+        {
+            std::cerr << "Error: Could not map image at 0x" << std::hex << run.first << std::dec << std::endl;
+            return false;
+        }
+    }
+    instruction_base = image.entry;
+    cpu.pc = image.entry;
+    return true;
+}
+
+void VM::snapshot()
+{
+    if (!snap)
+    {
+        snap = new Snapshot;
+        snap->memory = (uint8_t *)map_zeroed(ADDRESS_SPACE);
+    }
+    std::memcpy(snap->memory, memory, ADDRESS_SPACE);
+    snap->bank = bank;
+    snap->cpu = cpu;
+    snap->cpu_running = cpu_running;
+    snap->cycles = cycles;
+    snap->status = status;
+    snap->dirty_count = 0;
+    for (int page = 0; page < VM_PAGE_COUNT; page++)
+        page_flags[page] |= PAGE_TRACK;
+}
+
+bool VM::restore()
+{
+    if (!snap)
+        return false;
+    map_bank(snap->bank);
+    for (int i = 0; i < snap->dirty_count; i++)
+    {
+        uint8_t page = snap->dirty[i];
+        size_t start = page << VM_PAGE_SHIFT;
+        std::memcpy(memory + start, snap->memory + start, VM_PAGE_SIZE);
+        // Code cached from the page was decoded from the bytes just replaced
+        if (page_flags[page] & (PAGE_DECODED | PAGE_JIT))
+            invalidate_page(*this, page);
+        page_flags[page] |= PAGE_TRACK;
+    }
+    snap->dirty_count = 0;
+    cpu = snap->cpu;
+    cpu_running = snap->cpu_running;
+    cycles = snap->cycles;
+    status = snap->status;
+    return true;
+}
+
+// A store hit a page with flags set: log it for restore() if it was still
+// clean, and drop any code cached from it
+void VM::page_written(uint8_t page)
+{
+    if (page_flags[page] & PAGE_TRACK)
+    {
+        page_flags[page] &= ~PAGE_TRACK;
+        snap->dirty[snap->dirty_count++] = page;
+    }
+    if (page_flags[page] & (PAGE_DECODED | PAGE_JIT))
+        invalidate_page(*this, page);
+}
+
+// note_store() for every page of a block store
+void VM::note_store_range(uint16_t addr, uint16_t len)
+{
+    if (len == 0)
+        return;
+    uint8_t page = addr >> VM_PAGE_SHIFT;
+    uint8_t last = (uint16_t)(addr + len - 1) >> VM_PAGE_SHIFT;
     while (true)
     {
-        auto now = std::chrono::high_resolution_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
-        if (elapsed >= cycles * 1000) // Assuming 1 cycle = 1000 microseconds
+        if (page_flags[page])
+            page_written(page);
+        if (page == last)
             break;
+        page++; // wraps with the range
+    }
+}
+
+void VM::block_copy(uint16_t dst, uint16_t src, uint16_t len)
+{
+    if (len == 0 || dst == src)
+        return;
+    if (dst + len <= 0x10000 && src + len <= 0x10000)
+        std::memmove(memory + dst, memory + src, len);
+    else
+    {
+        // A range wraps, so the two may overlap at both ends: stage the
+        // source, in a buffer made on first use and kept off the host stack
+        if (!staging)
+            staging = (uint8_t *)map_zeroed(ADDRESS_SPACE);
+        uint32_t head = std::min<uint32_t>(len, 0x10000 - src);
+        std::memcpy(staging, memory + src, head);
+        std::memcpy(staging + head, memory, len - head);
+        head = std::min<uint32_t>(len, 0x10000 - dst);
+        std::memcpy(memory + dst, staging, head);
+        std::memcpy(memory, staging + head, len - head);
+    }
+    note_store_range(dst, len);
+}
+
+void VM::block_fill(uint16_t dst, uint8_t value, uint16_t len)
+{
+    uint32_t head = std::min<uint32_t>(len, 0x10000 - dst);
+    std::memset(memory + dst, value, head);
+    std::memset(memory, value, len - head);
+    note_store_range(dst, len);
+}
+
+int VM::block_compare(uint16_t x, uint16_t y, uint16_t len) const
+{
+    // In runs that wrap neither address
+    while (len)
+    {
+        uint32_t run = std::min<uint32_t>({len, 0x10000u - x, 0x10000u - y});
+        int order = std::memcmp(memory + x, memory + y, run);
+        if (order)
+            return order;
+        x += run;
+        y += run;
+        len -= run;
+    }
+    return 0;
+}
+
+// Stop on a run-time error and return the stream to describe it on.
+// Pending guest output goes first so the two appear in order on a terminal.
+std::ostream &VM::fault()
+{
+    out.flush();
+    cpu_running = false;
+    status = RUN_FAULT;
+    return std::cerr;
+}
+
+// Whether IN_A may go ahead. With blocking_input off it must not wait, so
+// it only proceeds once stdin has data (or is at end of file).
+bool VM::input_ready()
+{
+    if (blocking_input || std::cin.rdbuf()->in_avail() > 0)
+        return true;
+    pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&fd, 1, 0) > 0;
+}
+
+// Report a stack overflow or underflow at the instruction at `pc` and stop
+void VM::stack_fault(bool overflow, uint16_t pc)
+{
+    fault() << "Stack " << (overflow ? "overflow" : "underflow") << " at PC: " << pc << std::endl;
+}
+
+// Pass `units` milliseconds of guest time. The virtual clock always moves on
+// by that much; in real-time mode the host thread also sleeps, rather than
+// spinning, until the matching wall-clock deadline.
+void VM::wait(uint16_t units)
+{
+    cycles += (uint64_t)units * CYCLES_PER_WAIT;
+    if (wait_mode == WAIT_REALTIME)
+    {
+        out.flush(); // let output written before the pause show up
+        std::this_thread::sleep_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(units));
+    }
+}
+
+// VLOAD and VSTORE: register `reg` from or to the 16 bytes at `addr`,
+// little-endian 16-bit lanes, wrapping past 0xFFFF
+void VM::vector_load(uint8_t reg, uint16_t addr)
+{
+    uint16_t *v = cpu.v[reg];
+#if defined(__SSE2__)
+    if (addr <= 0x10000 - 2 * VECTOR_LANES)
+    {
+        vector_put(v, _mm_loadu_si128((const __m128i *)(memory + addr)));
+        return;
+    }
+#endif
+    for (int i = 0; i < VECTOR_LANES; i++)
+        v[i] = memory[(uint16_t)(addr + 2 * i)] | (memory[(uint16_t)(addr + 2 * i + 1)] << 8);
+}
+
+void VM::vector_store(uint8_t reg, uint16_t addr)
+{
+    const uint16_t *v = cpu.v[reg];
+#if defined(__SSE2__)
+    if (addr <= 0x10000 - 2 * VECTOR_LANES)
+        _mm_storeu_si128((__m128i *)(memory + addr), vector_get(v));
+    else
+#endif
+    {
+        for (int i = 0; i < VECTOR_LANES; i++)
+        {
+            memory[(uint16_t)(addr + 2 * i)] = v[i] & 0xFF;
+            memory[(uint16_t)(addr + 2 * i + 1)] = v[i] >> 8;
+        }
+    }
+    note_store_range(addr, 2 * VECTOR_LANES);
+}
+
+// SYS_WRITE: `len` bytes of guest memory at `addr`, wrapping past 0xFFFF
+void VM::write_block(uint16_t addr, uint16_t len)
+{
+    uint32_t head = std::min<uint32_t>(len, 0x10000 - addr);
+    out.put_bytes(memory + addr, head);
+    out.put_bytes(memory, len - head);
+}
+
+// SYS_PUTS: the NUL-terminated string at `addr`. Without a NUL anywhere,
+// all of memory from `addr` on.
+void VM::write_string(uint16_t addr)
+{
+    uint32_t head = 0x10000 - addr;
+    const uint8_t *end = (const uint8_t *)std::memchr(memory + addr, 0, head);
+    if (end)
+    {
+        out.put_bytes(memory + addr, end - (memory + addr));
+        return;
     }
+    out.put_bytes(memory + addr, head);
+    end = (const uint8_t *)std::memchr(memory, 0, addr);
+    out.put_bytes(memory, end ? end - memory : addr);
 }
 
-void start()
+// SYS_READLINE and SYS_READ: up to `len` bytes of stdin into memory at
+// `addr`, wrapping past 0xFFFF. A line read stops after its newline, a
+// block read only at the end of input. Returns how many bytes were stored.
+uint16_t VM::read_input(uint16_t addr, uint16_t len, bool line)
+{
+    out.flush(); // a prompt shows up before the read blocks
+    std::streambuf *in = std::cin.rdbuf();
+    uint16_t count = 0;
+    if (line)
+    {
+        while (count < len)
+        {
+            int ch = in->sbumpc();
+            if (ch == EOF)
+                break;
+            memory[(uint16_t)(addr + count++)] = ch;
+            if (ch == '\n')
+                break;
+        }
+    }
+    else
+    {
+        uint32_t head = std::min<uint32_t>(len, 0x10000 - addr);
+        count = in->sgetn((char *)memory + addr, head);
+        if (count == head)
+            count += in->sgetn((char *)memory, len - head);
+    }
+    note_store_range(addr, count);
+    return count;
+}
 
+// Reference interpreter: one switch per instruction, state kept in `cpu`.
+uint64_t VM::run_switch(uint64_t budget)
 {
     int8 rem;
     uint8_t arg1, arg2;
     uint16_t addr;
     char reg, reg1;
-    while (cpu_running)
+    uint64_t retired = 0;
+    while (cpu_running && retired < budget)
     {
+        uint16_t pc = cpu.pc;
+        bool taken = false; // for the profile: the branch, call or return went to its target
         int8 opcode = memory[cpu.pc++];
+        cycles++;
+        retired++;
         switch (opcode)
         {
         case NOP:
@@ -90,30 +670,38 @@ void start()
             }
             break;
         case PRINT_A:
-            std::cout << std::dec << cpu.a;
+            out.put_dec(cpu.a);
             break;
         case PRINT_R:
             reg = (char)memory[cpu.pc++];
             switch (reg)
             {
             case 'a':
-                std::cout << cpu.a;
+                out.put_dec(cpu.a);
                 break;
             case 'b':
-                std::cout << cpu.b;
+                out.put_dec(cpu.b);
                 break;
             case 'c':
-                std::cout << cpu.c;
+                out.put_dec(cpu.c);
                 break;
             default:
-                std::cerr << "Unknown register: " << reg << std::endl;
-                cpu_running = false; // Stop execution on unknown register
+                fault() << "Unknown register: " << reg << std::endl;
             }
             break;
         case PRINT_CHAR:
-            std::cout << static_cast<char>(cpu.a & 0xFF);
+            out.put_char(cpu.a & 0xFF);
             break;
         case IN_A:
+            if (!input_ready())
+            {
+                // Not retired: the next run() executes it again
+                cpu.pc--;
+                cycles--;
+                status = RUN_INPUT;
+                return retired - 1;
+            }
+            out.flush();
             cpu.a = std::cin.get();
             break;
         case JMP:
@@ -121,19 +709,22 @@ void start()
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
             cpu.pc = addr;
+            taken = true;
             break;
         case JZ:
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (cpu.zero_flag)
+            taken = cpu.zero_flag;
+            if (taken)
                 cpu.pc = addr;
             break;
         case JNZ:
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (!cpu.zero_flag)
+            taken = !cpu.zero_flag;
+            if (taken)
                 cpu.pc = addr;
             break;
         case HLT:
@@ -143,54 +734,46 @@ void start()
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (cpu.negative_flag)
+            taken = cpu.negative_flag;
+            if (taken)
                 cpu.pc = addr;
             break;
         case JP:
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (!cpu.negative_flag && !cpu.zero_flag)
+            taken = !cpu.negative_flag && !cpu.zero_flag;
+            if (taken)
                 cpu.pc = addr;
             break;
         case LOAD_A_MEM:
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (addr < MEMORY_MAX)
-            {
-                cpu.a = (memory[addr] << 8) | memory[addr + 1];
-            }
+            cpu.a = (memory[addr] << 8) | memory[addr + 1];
             break;
         case STORE_A_MEM:
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (addr < MEMORY_MAX)
-            {
-                arg1 = cpu.a & 0xFF; // Lower byte
-                arg2 = (cpu.a >> 8) & 0xFF;
-                memory[addr] = arg1;
-                memory[addr + 1] = arg2;
-            }
+            arg1 = cpu.a & 0xFF; // Lower byte
+            arg2 = (cpu.a >> 8) & 0xFF;
+            memory[addr] = arg1;
+            memory[addr + 1] = arg2;
+            note_store16(addr);
             break;
         case LOAD8_A_MEM:
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (addr < MEMORY_MAX)
-            {
-                cpu.a = memory[addr];
-            }
+            cpu.a = memory[addr];
             break;
         case STORE8_A_MEM:
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (addr < MEMORY_MAX)
-            {
-                memory[addr] = cpu.a & 0xFF;
-            }
+            memory[addr] = cpu.a & 0xFF;
+            note_store(addr);
             break;
         case MOV_MEM_IMM:
             arg1 = memory[cpu.pc++];
@@ -200,6 +783,7 @@ void start()
             arg2 = memory[cpu.pc++];
             memory[addr] = arg1;
             memory[addr + 1] = arg2; // Store as 16-bit
+            note_store16(addr);
             break;
 
         case MOV_REG_IMM:
@@ -242,10 +826,12 @@ void start()
             case 'a':
                 memory[addr] = cpu.a & 0xFF;
                 memory[addr + 1] = (cpu.a >> 8) & 0xFF; // Store as 16-bit
+                note_store16(addr);
                 break;
             case 'b':
                 memory[addr] = cpu.b & 0xFF;
                 memory[addr + 1] = (cpu.b >> 8) & 0xFF;
+                note_store16(addr);
                 break;
             default:
                 break;
@@ -316,10 +902,12 @@ void start()
             case 'a':
                 memory[addr] = cpu.a & 0xFF;
                 memory[addr + 1] = (cpu.a >> 8) & 0xFF; // Store as 16-bit
+                note_store16(addr);
                 break;
             case 'b':
                 memory[addr] = cpu.b & 0xFF;
                 memory[addr + 1] = (cpu.b >> 8) & 0xFF;
+                note_store16(addr);
                 break;
             default:
                 break;
@@ -332,8 +920,91 @@ void start()
             addr = (arg1 << 8) | arg2; // Combine low and high byte
             arg1 = memory[cpu.pc++];
             memory[addr] = arg1;
+            note_store(addr);
             break;
 
+        case MEMCPY:
+            block_copy(cpu.a, cpu.b, cpu.c);
+            break;
+        case MEMSET:
+            block_fill(cpu.a, cpu.b & 0xFF, cpu.c);
+            break;
+        case MEMCMP:
+        {
+            int order = block_compare(cpu.a, cpu.b, cpu.c);
+            cpu.zero_flag = (order == 0);
+            cpu.negative_flag = (order < 0);
+            break;
+        }
+
+        case BANK:
+            select_bank(cpu.a);
+            break;
+
+        case VLOAD:
+        case VSTORE:
+        case VSPLAT:
+        case VSUM:
+        case VMIN:
+        case VMAX:
+            arg1 = memory[cpu.pc++];
+            if (arg1 >= VECTOR_REGS)
+                break; // ignored, like an unknown scalar register
+            if (opcode == VLOAD)
+                vector_load(arg1, cpu.b);
+            else if (opcode == VSTORE)
+                vector_store(arg1, cpu.b);
+            else if (opcode == VSPLAT)
+                vector_splat(cpu.v[arg1], cpu.a);
+            else if (opcode == VSUM)
+                cpu.a = vector_reduce<VSUM>(cpu.v[arg1]);
+            else if (opcode == VMIN)
+                cpu.a = vector_reduce<VMIN>(cpu.v[arg1]);
+            else
+                cpu.a = vector_reduce<VMAX>(cpu.v[arg1]);
+            break;
+
+        case VADD:
+        case VSUB:
+        case VAND:
+        case VOR:
+        case VXOR:
+        case VCMPEQ:
+        case VCMPGT:
+        {
+            arg1 = memory[cpu.pc++];
+            arg2 = memory[cpu.pc++];
+            if (arg1 >= VECTOR_REGS || arg2 >= VECTOR_REGS)
+                break;
+            uint16_t *x = cpu.v[arg1];
+            const uint16_t *y = cpu.v[arg2];
+            switch (opcode)
+            {
+            case VADD:
+                vector_lanes<VADD>(x, y);
+                break;
+            case VSUB:
+                vector_lanes<VSUB>(x, y);
+                break;
+            case VAND:
+                vector_lanes<VAND>(x, y);
+                break;
+            case VOR:
+                vector_lanes<VOR>(x, y);
+                break;
+            case VXOR:
+                vector_lanes<VXOR>(x, y);
+                break;
+            case VCMPEQ:
+                vector_lanes<VCMPEQ>(x, y);
+                break;
+            default:
+                vector_lanes<VCMPGT>(x, y);
+                break;
+            }
+            break;
+        }
+
         case CMP:
             cpu.zero_flag = (cpu.c == cpu.b);
             cpu.negative_flag = (cpu.b < cpu.c);
@@ -344,7 +1015,8 @@ void start()
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (cpu.b == cpu.c)
+            taken = cpu.b == cpu.c;
+            if (taken)
                 cpu.pc = addr;
             break;
 
@@ -352,7 +1024,8 @@ void start()
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (cpu.b > cpu.c)
+            taken = cpu.b > cpu.c;
+            if (taken)
                 cpu.pc = addr;
             break;
 
@@ -360,7 +1033,8 @@ void start()
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            if (cpu.b < cpu.c)         // If A > B, then B < A, which is what we want for the counter check
+            taken = cpu.b < cpu.c; // If A > B, then B < A, which is what we want for the counter check
+            if (taken)
                 cpu.pc = addr;
             break;
 
@@ -368,38 +1042,37 @@ void start()
             arg1 = memory[cpu.pc++];
             arg2 = memory[cpu.pc++];
             addr = (arg1 << 8) | arg2; // Combine low and high byte
-            cpu.stack.push(cpu.pc);
-            cpu.pc = addr;
+            taken = push(cpu.pc);
+            if (taken)
+                cpu.pc = addr;
+            else
+                stack_fault(true, cpu.pc - 3);
             break;
 
         case RET:
-            if (!cpu.stack.empty())
-            {
-                cpu.pc = cpu.stack.top();
-                cpu.stack.pop();
-            }
+            taken = pop(addr);
+            if (taken)
+                cpu.pc = addr;
+            else
+                stack_fault(false, cpu.pc - 1);
             break;
 
         case PUSH_A:
-            cpu.stack.push(cpu.a);
+            if (!push(cpu.a))
+                stack_fault(true, cpu.pc - 1);
             break;
         case POP_A:
-            if (!cpu.stack.empty())
-            {
-                cpu.a = cpu.stack.top();
-                cpu.stack.pop();
-            }
+            if (!pop(cpu.a))
+                stack_fault(false, cpu.pc - 1);
             break;
         case PUSH_B:
-            cpu.stack.push(cpu.b);
+            if (!push(cpu.b))
+                stack_fault(true, cpu.pc - 1);
             break;
 
         case POP_B:
-            if (!cpu.stack.empty())
-            {
-                cpu.b = cpu.stack.top();
-                cpu.stack.pop();
-            }
+            if (!pop(cpu.b))
+                stack_fault(false, cpu.pc - 1);
             break;
         case AND:
             cpu.a &= cpu.b;
@@ -421,11 +1094,19 @@ void start()
             break;
         case WAIT:
             arg1 = memory[cpu.pc++];
-            wait_cycles(arg1);
+            wait(arg1);
             break;
         case SYSCALL:
         {
             uint16_t syscall_num = cpu.a;
+            if ((syscall_num == 0x06 || syscall_num == 0x07) && !input_ready())
+            {
+                // Not retired, like IN_A
+                cpu.pc--;
+                cycles--;
+                status = RUN_INPUT;
+                return retired - 1;
+            }
 
             switch (syscall_num)
             {
@@ -433,15 +1114,32 @@ void start()
                 break;
 
             case 0x01:              // SYS_WAIT
-                wait_cycles(cpu.b); // wait for B cycles
+                wait(cpu.b); // wait for B cycles
                 break;
 
             case 0x02: // SYS_PRINTA
-                std::cout << cpu.b << std::endl;
+                out.put_dec(cpu.b);
+                out.put_char('\n');
                 break;
 
             case 0x03: // SYS_PRINTC
-                std::cout << static_cast<char>(cpu.b & 0xFF);
+                out.put_char(cpu.b & 0xFF);
+                break;
+
+            case 0x04: // SYS_WRITE - C bytes at B
+                write_block(cpu.b, cpu.c);
+                break;
+
+            case 0x05: // SYS_PUTS - NUL-terminated string at B
+                write_string(cpu.b);
+                break;
+
+            case 0x06: // SYS_READLINE - a line of at most C bytes to B, A = length
+                cpu.a = read_input(cpu.b, cpu.c, true);
+                break;
+
+            case 0x07: // SYS_READ - C bytes, or up to end of input, to B; A = length
+                cpu.a = read_input(cpu.b, cpu.c, false);
                 break;
 
             case 0xFF: // SYS_EXIT
@@ -449,8 +1147,7 @@ void start()
                 break;
 
             default:
-                std::cerr << "Unknown syscall: " << syscall_num << std::endl;
-                cpu_running = false;
+                fault() << "Unknown syscall: " << syscall_num << std::endl;
                 break;
             }
             break;
@@ -463,40 +1160,584 @@ void start()
             switch (int_num)
             {
             case 0x10: // INT 10h - print character in B
-                std::cout << static_cast<char>(cpu.b & 0xFF);
+                out.put_char(cpu.b & 0xFF);
                 break;
 
             case 0x11: // INT 11h - print A as integer
-                std::cout << cpu.b << std::endl;
+                out.put_dec(cpu.b);
+                out.put_char('\n');
                 break;
 
             case 0x12: // INT 12h - wait B cycles
-                wait_cycles(cpu.b);
+                wait(cpu.b);
                 break;
 
             case 0x13: // INT 13h - reboot (reset)
-                cpu.reset();
+                cpu.reset(instruction_base, stack_top);
                 break;
 
             default:
-                std::cerr << "Unhandled INT " << std::hex << (int)int_num << "\n";
-                cpu_running = false;
+                fault() << "Unhandled INT " << std::hex << (int)int_num << "\n";
                 break;
             }
             break;
         }
 
         case RESET:
-            cpu.reset();
+            cpu.reset(instruction_base, stack_top);
             break;
         case HALT:
             cpu_running = false;
             break;
         default:
             // Unknown opcode
-            std::cerr << "Unknown opcode: " << static_cast<int>(opcode) << " at PC: " << cpu.pc - 1 << std::endl;
-            cpu_running = false; // Stop execution on unknown opcode
+            fault() << "Unknown opcode: " << static_cast<int>(opcode) << " at PC: " << cpu.pc - 1 << std::endl;
+            break;
+        }
+
+        if (profile)
+            profile->record(pc, opcode, cpu.pc, taken);
+    }
+    return retired;
+}
+
+// Direct-threaded interpreter over the decode cache. Each instruction is
+// decoded once into a DecodedInsn whose handler field is the address of its
+// label below; every handler ends by jumping straight to the next record's
+// handler, so each one gets its own indirect branch for the predictor.
+// PC and A/B/C live in locals; cpu_running is only polled on control-flow
+// changes, since straight-line code can only stop itself through a halt,
+// and so is the budget.
+// With single_block set it returns at the first taken control transfer,
+// which is how run_jit() interprets blocks that have no translation.
+uint64_t VM::run_threaded(bool single_block, uint64_t budget)
+{
+    static const void *const handlers[D_COUNT] = {
+#define DECODED_OP_LABEL(name) &&h_##name,
+        DECODED_OPS(DECODED_OP_LABEL)
+#undef DECODED_OP_LABEL
+    };
+
+    uint16_t a = cpu.a, b = cpu.b, c = cpu.c;
+    uint16_t addr;
+    const DecodedInsn *d;
+    uint64_t retired = 0; // added to the clock on the way out
+
+    // The current record doubles as the PC: records are indexed by guest
+    // address, so the next instruction's record is always d + d->len.
+    // Handlers count themselves as retired as they leave.
+#define PC() ((uint16_t)(d - decode_cache))
+#define NEXT_PC() ((uint16_t)(PC() + d->len))
+#define DISPATCH_AT(record)                   \
+    do                                        \
+    {                                         \
+        d = (record);                         \
+        if (__builtin_expect(!d->handler, 0)) \
+            goto miss;                        \
+        goto *d->handler;                     \
+    } while (0)
+#define DISPATCH()                   \
+    do                               \
+    {                                \
+        retired += d->count;         \
+        DISPATCH_AT(d + d->len);     \
+    } while (0)
+#define JUMP(target)                        \
+    do                                      \
+    {                                       \
+        addr = (target);                    \
+        retired += d->count;                \
+        if (!cpu_running || single_block || \
+            retired >= budget)              \
+        {                                   \
+            d = &decode_cache[addr];        \
+            goto leave;                     \
+        }                                   \
+        DISPATCH_AT(&decode_cache[addr]);   \
+    } while (0)
+// Halting handlers leave the PC just past themselves, like run_switch()
+#define STOP()                \
+    do                        \
+    {                         \
+        cpu_running = false;  \
+        retired += d->count;  \
+        d += d->len;          \
+        goto leave;           \
+    } while (0)
+#define SAVE_REGS() (cpu.pc = PC(), cpu.a = a, cpu.b = b, cpu.c = c)
+#define LOAD_REGS() (a = cpu.a, b = cpu.b, c = cpu.c)
+
+    if (!cpu_running)
+        return 0;
+    DISPATCH_AT(&decode_cache[cpu.pc]);
+
+miss:
+{
+    // Not decoded yet, or stepped past 0xFFFF into the wrap-around slack
+    uint16_t pc = PC();
+    DecodedInsn *record = &decode_cache[pc];
+    if (!record->handler)
+    {
+        decode_fused(*this, pc, *record);
+        record->handler = handlers[record->op];
+    }
+    d = record;
+    goto *d->handler;
+}
+
+h_NOP:
+    DISPATCH();
+
+h_LD_A:
+    a = d->imm;
+    DISPATCH();
+h_LD_B:
+    b = d->imm;
+    DISPATCH();
+h_LD_C:
+    c = d->imm;
+    DISPATCH();
+h_MOV_A_B:
+    a = b;
+    DISPATCH();
+h_MOV_B_A:
+    b = a;
+    DISPATCH();
+h_INC_A:
+    ++a;
+    DISPATCH();
+h_INC_B:
+    ++b;
+    DISPATCH();
+h_INC_C:
+    ++c;
+    DISPATCH();
+
+h_ADD:
+    a += b;
+    DISPATCH();
+h_SUB:
+    a -= b;
+    DISPATCH();
+h_MUL:
+    a *= b;
+    DISPATCH();
+h_DIV:
+    if (b != 0)
+        a /= b;
+    DISPATCH();
+h_MOD:
+    if (b != 0)
+        a %= b;
+    DISPATCH();
+h_AND:
+    a &= b;
+    DISPATCH();
+h_OR:
+    a |= b;
+    DISPATCH();
+h_XOR:
+    a ^= b;
+    DISPATCH();
+h_NOT:
+    a = ~a;
+    DISPATCH();
+h_SHL:
+    a <<= 1;
+    DISPATCH();
+h_SHR:
+    a >>= 1;
+    DISPATCH();
+
+h_PRINT_A:
+    out.put_dec(a);
+    DISPATCH();
+h_PRINT_R_A:
+    out.put_dec(a);
+    DISPATCH();
+h_PRINT_R_B:
+    out.put_dec(b);
+    DISPATCH();
+h_PRINT_R_C:
+    out.put_dec(c);
+    DISPATCH();
+h_PRINT_R_BAD:
+    fault() << "Unknown register: " << (char)d->imm << std::endl;
+    STOP();
+h_PRINT_CHAR:
+    out.put_char(a & 0xFF);
+    DISPATCH();
+h_IN_A:
+    if (!input_ready())
+    {
+        status = RUN_INPUT; // left unretired, to run again next time
+        goto leave;
+    }
+    out.flush();
+    a = std::cin.get();
+    DISPATCH();
+
+h_JMP:
+    JUMP(d->imm);
+h_JZ:
+    if (cpu.zero_flag)
+        JUMP(d->imm);
+    DISPATCH();
+h_JNZ:
+    if (!cpu.zero_flag)
+        JUMP(d->imm);
+    DISPATCH();
+h_JN:
+    if (cpu.negative_flag)
+        JUMP(d->imm);
+    DISPATCH();
+h_JP:
+    if (!cpu.negative_flag && !cpu.zero_flag)
+        JUMP(d->imm);
+    DISPATCH();
+h_JEQ:
+    if (b == c)
+        JUMP(d->imm);
+    DISPATCH();
+h_JGT:
+    if (b > c)
+        JUMP(d->imm);
+    DISPATCH();
+h_JLT:
+    if (b < c)
+        JUMP(d->imm);
+    DISPATCH();
+h_CMP:
+    cpu.zero_flag = (c == b);
+    cpu.negative_flag = (b < c);
+    DISPATCH();
+
+h_LOAD8_A:
+    a = memory[d->imm];
+    DISPATCH();
+h_LOAD8_B:
+    b = memory[d->imm];
+    DISPATCH();
+h_LOAD16_A:
+    a = memory[d->imm] | (memory[d->imm + 1] << 8);
+    DISPATCH();
+h_LOAD16_B:
+    b = memory[d->imm] | (memory[d->imm + 1] << 8);
+    DISPATCH();
+h_LOAD16BE_A:
+    a = (memory[d->imm] << 8) | memory[d->imm + 1];
+    DISPATCH();
+
+    // Stores read every operand before writing: the write may invalidate
+    // the record `d` points at
+h_STORE8_A:
+    addr = d->imm;
+    memory[addr] = a & 0xFF;
+    note_store(addr);
+    DISPATCH();
+h_STORE16_A:
+    addr = d->imm;
+    memory[addr] = a & 0xFF;
+    memory[addr + 1] = (a >> 8) & 0xFF;
+    note_store16(addr);
+    DISPATCH();
+h_STORE16_B:
+    addr = d->imm;
+    memory[addr] = b & 0xFF;
+    memory[addr + 1] = (b >> 8) & 0xFF;
+    note_store16(addr);
+    DISPATCH();
+h_STORE_IMM8:
+    addr = d->imm;
+    memory[addr] = d->imm2 & 0xFF;
+    note_store(addr);
+    DISPATCH();
+h_STORE_IMM16:
+{
+    uint16_t value = d->imm2;
+    addr = d->imm;
+    memory[addr] = value >> 8;
+    memory[addr + 1] = value & 0xFF;
+    note_store16(addr);
+    DISPATCH();
+}
+
+h_MEMCPY:
+    block_copy(a, b, c);
+    DISPATCH();
+h_MEMSET:
+    block_fill(a, b & 0xFF, c);
+    DISPATCH();
+h_MEMCMP:
+{
+    int order = block_compare(a, b, c);
+    cpu.zero_flag = (order == 0);
+    cpu.negative_flag = (order < 0);
+    DISPATCH();
+}
+
+h_BANK:
+    if (!select_bank(a))
+        STOP();
+    DISPATCH();
+
+h_VLOAD:
+    vector_load(d->imm, b);
+    DISPATCH();
+h_VSTORE:
+    vector_store(d->imm, b);
+    DISPATCH();
+h_VSPLAT:
+    vector_splat(cpu.v[d->imm], a);
+    DISPATCH();
+h_VADD:
+    vector_lanes<VADD>(cpu.v[d->imm], cpu.v[d->imm2]);
+    DISPATCH();
+h_VSUB:
+    vector_lanes<VSUB>(cpu.v[d->imm], cpu.v[d->imm2]);
+    DISPATCH();
+h_VAND:
+    vector_lanes<VAND>(cpu.v[d->imm], cpu.v[d->imm2]);
+    DISPATCH();
+h_VOR:
+    vector_lanes<VOR>(cpu.v[d->imm], cpu.v[d->imm2]);
+    DISPATCH();
+h_VXOR:
+    vector_lanes<VXOR>(cpu.v[d->imm], cpu.v[d->imm2]);
+    DISPATCH();
+h_VCMPEQ:
+    vector_lanes<VCMPEQ>(cpu.v[d->imm], cpu.v[d->imm2]);
+    DISPATCH();
+h_VCMPGT:
+    vector_lanes<VCMPGT>(cpu.v[d->imm], cpu.v[d->imm2]);
+    DISPATCH();
+h_VSUM:
+    a = vector_reduce<VSUM>(cpu.v[d->imm]);
+    DISPATCH();
+h_VMIN:
+    a = vector_reduce<VMIN>(cpu.v[d->imm]);
+    DISPATCH();
+h_VMAX:
+    a = vector_reduce<VMAX>(cpu.v[d->imm]);
+    DISPATCH();
+
+    // Pushes store, so they too read operands first
+h_CALL:
+    addr = d->imm;
+    if (!push(NEXT_PC()))
+        goto overflow;
+    JUMP(addr);
+h_RET:
+    if (!pop(addr))
+        goto underflow;
+    JUMP(addr);
+h_PUSH_A:
+    if (!push(a))
+        goto overflow;
+    DISPATCH();
+h_POP_A:
+    if (!pop(a))
+        goto underflow;
+    DISPATCH();
+h_PUSH_B:
+    if (!push(b))
+        goto overflow;
+    DISPATCH();
+h_POP_B:
+    if (!pop(b))
+        goto underflow;
+    DISPATCH();
+overflow:
+    stack_fault(true, PC());
+    STOP();
+underflow:
+    stack_fault(false, PC());
+    STOP();
+
+h_WAIT:
+    wait(d->imm);
+    DISPATCH();
+
+h_SYSCALL:
+    switch (a)
+    {
+    case 0x00: // SYS_NOP
+        break;
+    case 0x01: // SYS_WAIT
+        wait(b);
+        break;
+    case 0x02: // SYS_PRINTA
+        out.put_dec(b);
+        out.put_char('\n');
+        break;
+    case 0x03: // SYS_PRINTC
+        out.put_char(b & 0xFF);
+        break;
+    case 0x04: // SYS_WRITE
+        write_block(b, c);
+        break;
+    case 0x05: // SYS_PUTS
+        write_string(b);
+        break;
+    case 0x06: // SYS_READLINE
+    case 0x07: // SYS_READ
+        if (!input_ready())
+        {
+            status = RUN_INPUT; // left unretired, like IN_A
+            goto leave;
+        }
+        a = read_input(b, c, a == 0x06);
+        break;
+    case 0xFF: // SYS_EXIT
+        STOP();
+    default:
+        fault() << "Unknown syscall: " << a << std::endl;
+        STOP();
+    }
+    DISPATCH();
+
+h_INT:
+    switch (d->imm)
+    {
+    case 0x10: // INT 10h - print character in B
+        out.put_char(b & 0xFF);
+        break;
+    case 0x11: // INT 11h - print B as integer
+        out.put_dec(b);
+        out.put_char('\n');
+        break;
+    case 0x12: // INT 12h - wait B cycles
+        wait(b);
+        break;
+    case 0x13: // INT 13h - reboot (reset)
+        cpu.reset(instruction_base, stack_top);
+        cpu.c = c;
+        LOAD_REGS();
+        JUMP(cpu.pc);
+    default:
+        fault() << "Unhandled INT " << std::hex << (int)d->imm << "\n";
+        STOP();
+    }
+    DISPATCH();
+
+h_RESET:
+    cpu.reset(instruction_base, stack_top);
+    cpu.c = c;
+    LOAD_REGS();
+    JUMP(cpu.pc);
+
+h_HALT:
+    STOP();
+
+h_ILLEGAL:
+    fault() << "Unknown opcode: " << (int)d->imm << " at PC: " << PC() << std::endl;
+    STOP();
+
+    // Superinstructions (see decode_fused)
+h_LDA_PRINT_CHAR:
+    a = d->imm;
+    out.put_char(a & 0xFF);
+    DISPATCH();
+h_LDA_PRINT_A:
+    a = d->imm;
+    out.put_dec(a);
+    DISPATCH();
+h_LDA_MUL_PRINT_A:
+    a = d->imm;
+    a *= b;
+    out.put_dec(a);
+    DISPATCH();
+h_MOV_A_B_PRINT_A:
+    a = b;
+    out.put_dec(a);
+    DISPATCH();
+h_INC_B_JLT:
+    ++b;
+    if (b < c)
+        JUMP(d->imm);
+    DISPATCH();
+h_CMP_JZ:
+    cpu.zero_flag = (c == b);
+    cpu.negative_flag = (b < c);
+    if (cpu.zero_flag)
+        JUMP(d->imm);
+    DISPATCH();
+h_CMP_JNZ:
+    cpu.zero_flag = (c == b);
+    cpu.negative_flag = (b < c);
+    if (!cpu.zero_flag)
+        JUMP(d->imm);
+    DISPATCH();
+
+leave:
+    SAVE_REGS();
+    cycles += retired;
+    return retired;
+
+#undef PC
+#undef NEXT_PC
+#undef DISPATCH_AT
+#undef DISPATCH
+#undef JUMP
+#undef STOP
+#undef SAVE_REGS
+#undef LOAD_REGS
+}
+
+// Tiered execution: hot blocks run as native code, everything else goes
+// through the threaded interpreter one basic block at a time
+uint64_t VM::run_jit(uint64_t budget)
+{
+    uint64_t left = budget;
+    while (cpu_running && left && status != RUN_INPUT)
+    {
+        if (!jit_execute(*this, left))
+            left -= std::min(left, run_threaded(true, left));
+    }
+    return budget - left;
+}
+
+RunStatus VM::run(uint64_t max_insns, std::chrono::steady_clock::time_point deadline)
+{
+    // Guest output bypasses std::cout, so anything the host printed first
+    // must be out before it
+    std::cout.flush();
+
+    status = RUN_BUDGET;
+    while (cpu_running && max_insns)
+    {
+        uint64_t slice = std::min<uint64_t>(max_insns, RUN_SLICE);
+        uint64_t done;
+        switch (profile ? DISPATCH_SWITCH : dispatch_mode)
+        {
+        case DISPATCH_THREADED:
+            done = run_threaded(false, slice);
+            break;
+        case DISPATCH_JIT:
+            done = run_jit(slice);
+            break;
+        case DISPATCH_SWITCH:
+        default:
+            done = run_switch(slice);
             break;
         }
+        max_insns -= std::min(done, max_insns);
+        if (status == RUN_INPUT)
+            break;
+        if (deadline != std::chrono::steady_clock::time_point::max() &&
+            std::chrono::steady_clock::now() >= deadline)
+            break;
     }
-}
\ No newline at end of file
+    out.flush();
+
+    if (!cpu_running && status == RUN_BUDGET)
+        status = RUN_HALTED;
+    return status;
+}
+
+void VM::start()
+{
+    // Memory may have been rewritten (reassembled, loaded) since last run
+    decode_flush(*this);
+    run(UINT64_MAX);
+}
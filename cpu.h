@@ -3,13 +3,229 @@
 
 #include <iostream>
 #include <chrono>
+#include <string>
+#include <vector>
+#include <sys/types.h>
 #include "setup.h"
+#include "decode.h"
+#include "object.h"
+#include "output.h"
 
-extern CPU cpu;
-extern bool cpu_running;
+struct JitState;
+struct Snapshot;
+class Profile;
+class SharedImage;
 
-// Function declarations
-void wait_cycles(uint8_t cycles);
-void start();
+// Interpreter loop used by VM::start()
+enum DispatchMode : uint8_t
+{
+    DISPATCH_SWITCH,   // one switch per instruction (reference)
+    DISPATCH_THREADED, // computed-goto, direct-threaded handlers
+    DISPATCH_JIT       // threaded, with hot blocks translated to x86-64
+};
 
-#endif // CPU_HPP
\ No newline at end of file
+// How WAIT, SYS_WAIT and INT 12h pass time
+enum WaitMode : uint8_t
+{
+    WAIT_REALTIME, // sleep the host thread for the requested time
+    WAIT_VIRTUAL   // only advance the virtual clock, return at once
+};
+
+// Why VM::run() returned
+enum RunStatus : uint8_t
+{
+    RUN_BUDGET, // instruction budget or deadline reached; call run() again
+    RUN_HALTED, // HALT or SYS_EXIT
+    RUN_INPUT,  // IN_A found no input (only when blocking_input is off)
+    RUN_FAULT   // stopped on an error, reported on stderr
+};
+
+// The virtual clock ticks once per retired instruction, as if the guest ran
+// at VM_CLOCK_HZ; a unit of WAIT is one millisecond of it
+#define VM_CLOCK_HZ 1000000
+#define CYCLES_PER_WAIT (VM_CLOCK_HZ / 1000)
+
+// Instructions run() executes between deadline checks
+#define RUN_SLICE 100000
+
+// One guest machine. A VM owns its memory, registers, stack, run state and
+// code caches and shares nothing with other instances but the read-only
+// pages of a SharedImage, so any number of them can run side by side, each
+// on its own host thread.
+class VM
+{
+public:
+    VM();
+    ~VM();
+    VM(const VM &) = delete;
+    VM &operator=(const VM &) = delete;
+
+    // ADDRESS_SPACE bytes, zero-filled on demand. The byte after the last,
+    // memory[0x10000], is memory[0] seen again, so a 16-bit access at
+    // 0xFFFF wraps like the address does.
+    uint8_t *memory;
+    CPU cpu;
+    bool cpu_running = true;
+    uint16_t instruction_base = 0x9000; // Start of instructions in memory
+
+    // The stack is [stack_top - stack_size, stack_top) of guest memory,
+    // 16-bit little-endian slots growing down from cpu.sp
+    uint16_t stack_top = MEMORY_MAX & ~1;
+    uint16_t stack_size = 0x400;
+    DispatchMode dispatch_mode = DISPATCH_SWITCH;
+    OutputBuffer out; // guest output, flushed when start() returns
+    uint64_t cycles = 0; // virtual clock, see VM_CLOCK_HZ
+    WaitMode wait_mode = WAIT_REALTIME;
+    RunStatus status = RUN_BUDGET; // outcome of the last run()
+    bool blocking_input = true;    // IN_A waits for input rather than pausing run()
+    Profile *profile = nullptr;    // when set, run on the switch loop and record into it
+
+    // Decode cache (decode.cpp): one record per guest address, plus slack
+    // for records stepped onto past 0xFFFF
+    DecodedInsn *decode_cache;
+    uint8_t page_flags[VM_PAGE_COUNT];
+    JitState *jit = nullptr; // created by the JIT on first use
+    Snapshot *snap = nullptr; // created by the first snapshot()
+    int memory_fd;            // backs `memory` and the banks
+    uint8_t *staging = nullptr; // ADDRESS_SPACE bytes, for block_copy() when a range wraps
+
+    // Banks that can be mapped into the window at BANK_WINDOW. Bank 0 is
+    // the window's own memory; the others come from a sparse file, so a
+    // bank takes no host memory until the guest writes to it.
+    uint32_t bank_count = 1;
+    uint16_t bank = 0; // mapped at BANK_WINDOW
+
+    // Give the VM `count` banks (1 to BANK_MAX). Reports on stderr and
+    // returns false if the host cannot provide them.
+    bool set_banks(uint32_t count);
+
+    void clearMemory();
+
+    // Put a raw binary image (as written by TextAssembler::saveToFile) into
+    // memory at `addr`. The file is mapped copy-on-write when `addr` is
+    // host page aligned, so only the pages the guest touches are read in;
+    // the rest of its last page then reads as zero. Reports on stderr and
+    // returns false if the file cannot be read or does not fit.
+    bool load_image(const std::string &path, uint16_t addr);
+
+    // Copy `size` bytes at `offset` of file `fd` into memory at `addr`, by
+    // mapping them when both are host page aligned (which also zeroes the
+    // rest of the last page) and with pread() otherwise. The first host
+    // page and the bank window are always read, as they must stay mapped
+    // from the VM's own memory.
+    bool load_region(int fd, off_t offset, size_t size, uint16_t addr);
+
+    // Map a program captured in a SharedImage into memory and point the
+    // VM at its entry. Reports on stderr and returns false on failure.
+    bool map_image(const SharedImage &image);
+
+    // Run until the guest stops. Call after loading a program: drops every
+    // cached decode of memory first.
+    void start();
+
+    // Run at most about `max_insns` instructions, or until `deadline`, and
+    // report why it stopped; the next call carries on from there. The limits
+    // are only checked at taken branches (and for the deadline, every
+    // RUN_SLICE instructions), so a call can overrun by the rest of a
+    // basic block. Call decode_flush() first if the host rewrote memory.
+    RunStatus run(uint64_t max_insns,
+                  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+    // Save memory and CPU state. Stores made afterwards are logged per
+    // page, so restore() copies back only the pages that changed. Taking a
+    // new snapshot replaces the previous one. Of the banks, only which one
+    // is mapped is saved: banks out of the window are not rewound.
+    void snapshot();
+
+    // Return memory, registers, run state and the virtual clock to the last
+    // snapshot(); false if none was taken. Guest output is not rewound.
+    bool restore();
+
+    // Call after every guest store so self-modifying code is re-decoded and
+    // snapshot pages are logged
+    void note_store(uint16_t addr)
+    {
+        if (page_flags[addr >> VM_PAGE_SHIFT])
+            page_written(addr >> VM_PAGE_SHIFT);
+    }
+    void note_store16(uint16_t addr)
+    {
+        note_store(addr);
+        note_store(addr + 1);
+    }
+
+    // MEMCPY, MEMSET and MEMCMP: `len` bytes from each address, wrapping
+    // past 0xFFFF to 0. The bytes are moved by the host's memmove(),
+    // memset() and memcmp(), which libc runs on the widest vector unit the
+    // CPU has. block_compare() returns what memcmp() would.
+    void block_copy(uint16_t dst, uint16_t src, uint16_t len);
+    void block_fill(uint16_t dst, uint8_t value, uint16_t len);
+    int block_compare(uint16_t x, uint16_t y, uint16_t len) const;
+
+    // Stack access through cpu.sp. Both return false, leaving everything
+    // untouched, on overflow or underflow; the caller raises the fault.
+    bool push(uint16_t value)
+    {
+        if (cpu.sp < stack_top - stack_size + 2)
+            return false;
+        cpu.sp -= 2;
+        memory[cpu.sp] = value & 0xFF;
+        memory[cpu.sp + 1] = value >> 8;
+        note_store16(cpu.sp);
+        return true;
+    }
+    bool pop(uint16_t &value)
+    {
+        if (cpu.sp + 2 > stack_top)
+            return false;
+        value = memory[cpu.sp] | (memory[cpu.sp + 1] << 8);
+        cpu.sp += 2;
+        return true;
+    }
+
+private:
+    void page_written(uint8_t page);
+    void map_bank(uint16_t number);
+    bool select_bank(uint16_t number);
+    void note_store_range(uint16_t addr, uint16_t len);
+    void vector_load(uint8_t reg, uint16_t addr);
+    void vector_store(uint8_t reg, uint16_t addr);
+    std::ostream &fault();
+    bool input_ready();
+    void stack_fault(bool overflow, uint16_t pc);
+    void wait(uint16_t units);
+    void write_block(uint16_t addr, uint16_t len);
+    void write_string(uint16_t addr);
+    uint16_t read_input(uint16_t addr, uint16_t len, bool line);
+    // Engines: run until stopped or `budget` instructions have retired
+    // (checked at taken branches), and return how many did
+    uint64_t run_switch(uint64_t budget);
+    uint64_t run_threaded(bool single_block, uint64_t budget);
+    uint64_t run_jit(uint64_t budget);
+};
+
+// A loaded program, captured once and mapped into any number of VMs. The
+// host pages holding its sections are kept in a memfd that VM::map_image()
+// maps copy-on-write: every instance reads the same physical pages, and
+// gets a private copy of a page only when it writes to it. Capture the
+// image before the source VM runs, as whole pages are taken, bytes around
+// the sections included. Pages in the first host page or the bank window
+// are copied into each VM rather than shared (see load_region()).
+class SharedImage
+{
+public:
+    // Throws std::bad_alloc if the host cannot create the memfd
+    SharedImage(const VM &vm, const std::vector<ObjectSection> &sections);
+    ~SharedImage();
+    SharedImage(const SharedImage &) = delete;
+    SharedImage &operator=(const SharedImage &) = delete;
+
+    uint16_t entry;
+
+private:
+    friend class VM;
+    int fd;
+    std::vector<std::pair<uint32_t, uint32_t>> runs; // [start, end) of host pages, sorted, disjoint
+};
+
+#endif // CPU_HPP
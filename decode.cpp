@@ -0,0 +1,367 @@
+#include "decode.h"
+#include "cpu.h"
+#include "jit.h"
+
+static inline uint8_t byte_at(const uint8_t *memory, uint16_t pc, int offset)
+{
+    return memory[(uint16_t)(pc + offset)];
+}
+
+static inline uint16_t word_at(const uint8_t *memory, uint16_t pc, int offset)
+{
+    return (byte_at(memory, pc, offset) << 8) | byte_at(memory, pc, offset + 1);
+}
+
+// Pick the per-register variant of an instruction, or NOP for a register
+// the original handler silently ignores
+static inline uint8_t by_reg(uint8_t reg, uint8_t op_a, uint8_t op_b, uint8_t op_c = D_NOP)
+{
+    switch ((char)reg)
+    {
+    case 'a':
+        return op_a;
+    case 'b':
+        return op_b;
+    case 'c':
+        return op_c;
+    default:
+        return D_NOP;
+    }
+}
+
+// Mark every page a record reads from, including a page it spills into
+static inline void mark_decoded(VM &vm, uint16_t pc, uint8_t len)
+{
+    vm.page_flags[pc >> VM_PAGE_SHIFT] |= PAGE_DECODED;
+    vm.page_flags[(uint16_t)(pc + len - 1) >> VM_PAGE_SHIFT] |= PAGE_DECODED;
+}
+
+void decode_bytes(const uint8_t *memory, uint16_t pc, DecodedInsn &d)
+{
+    uint8_t opcode = byte_at(memory, pc, 0);
+
+    d.imm = 0;
+    d.imm2 = 0;
+    d.len = 1;
+    d.count = 1;
+
+    switch (opcode)
+    {
+    case NOP:
+        d.op = D_NOP;
+        break;
+    case LDA_IMM:
+        d.op = D_LD_A;
+        d.imm = word_at(memory, pc, 1);
+        d.len = 3;
+        break;
+    case LDB_IMM:
+        d.op = D_LD_B;
+        d.imm = word_at(memory, pc, 1);
+        d.len = 3;
+        break;
+    case LDC_IMM:
+        d.op = D_LD_C;
+        d.imm = word_at(memory, pc, 1);
+        d.len = 3;
+        break;
+    case ADD:
+        d.op = D_ADD;
+        break;
+    case SUB:
+        d.op = D_SUB;
+        break;
+    case MUL:
+        d.op = D_MUL;
+        break;
+    case DIV:
+        d.op = D_DIV;
+        break;
+    case MOD:
+        d.op = D_MOD;
+        break;
+    case AND:
+        d.op = D_AND;
+        break;
+    case OR:
+        d.op = D_OR;
+        break;
+    case XOR:
+        d.op = D_XOR;
+        break;
+    case NOT:
+        d.op = D_NOT;
+        break;
+    case SHL:
+        d.op = D_SHL;
+        break;
+    case SHR:
+        d.op = D_SHR;
+        break;
+    case INC:
+        d.op = by_reg(byte_at(memory, pc, 1), D_INC_A, D_INC_B, D_INC_C);
+        d.len = 2;
+        break;
+
+    case PRINT_A:
+        d.op = D_PRINT_A;
+        break;
+    case PRINT_R:
+        d.op = by_reg(byte_at(memory, pc, 1), D_PRINT_R_A, D_PRINT_R_B, D_PRINT_R_C);
+        if (d.op == D_NOP)
+        {
+            d.op = D_PRINT_R_BAD;
+            d.imm = byte_at(memory, pc, 1);
+        }
+        d.len = 2;
+        break;
+    case PRINT_CHAR:
+        d.op = D_PRINT_CHAR;
+        break;
+    case IN_A:
+        d.op = D_IN_A;
+        break;
+
+    case JMP:
+    case JZ:
+    case JNZ:
+    case JN:
+    case JP:
+    case JEQ:
+    case JGT:
+    case JLT:
+    case CALL:
+        d.op = opcode == JMP   ? D_JMP
+               : opcode == JZ  ? D_JZ
+               : opcode == JNZ ? D_JNZ
+               : opcode == JN  ? D_JN
+               : opcode == JP  ? D_JP
+               : opcode == JEQ ? D_JEQ
+               : opcode == JGT ? D_JGT
+               : opcode == JLT ? D_JLT
+                               : D_CALL;
+        d.imm = word_at(memory, pc, 1);
+        d.len = 3;
+        break;
+    case CMP:
+        d.op = D_CMP;
+        break;
+
+    case LOAD_A_MEM:
+    case STORE_A_MEM:
+    case LOAD8_A_MEM:
+    case STORE8_A_MEM:
+        d.imm = word_at(memory, pc, 1);
+        d.len = 3;
+        d.op = opcode == LOAD_A_MEM    ? D_LOAD16BE_A
+               : opcode == STORE_A_MEM ? D_STORE16_A
+               : opcode == LOAD8_A_MEM ? D_LOAD8_A
+                                       : D_STORE8_A;
+        break;
+    case MOV_MEM_IMM:
+        d.op = D_STORE_IMM16;
+        d.imm = word_at(memory, pc, 1);
+        d.imm2 = word_at(memory, pc, 3);
+        d.len = 5;
+        break;
+    case MOV8_MEM_IMM:
+        d.op = D_STORE_IMM8;
+        d.imm = word_at(memory, pc, 1);
+        d.imm2 = byte_at(memory, pc, 3);
+        d.len = 4;
+        break;
+    case MOV_REG_IMM: // reg, unused 16-bit field, imm16
+        d.op = by_reg(byte_at(memory, pc, 1), D_LD_A, D_LD_B);
+        d.imm = word_at(memory, pc, 4);
+        d.len = 6;
+        break;
+    case MOV_REG_REG:
+        d.op = (char)byte_at(memory, pc, 1) == 'a' ? D_MOV_A_B : D_MOV_B_A;
+        d.len = 3;
+        break;
+    case MOV_MEM_REG:
+    case STORE:
+        d.op = by_reg(byte_at(memory, pc, 3), D_STORE16_A, D_STORE16_B);
+        d.imm = word_at(memory, pc, 1);
+        d.len = 4;
+        break;
+    case MOV_REG_MEM2:
+        d.op = by_reg(byte_at(memory, pc, 1), D_LOAD16_A, D_LOAD16_B);
+        d.imm = word_at(memory, pc, 2);
+        d.len = 4;
+        break;
+    case MOV_REG_MEM:
+    case LOAD:
+        d.op = by_reg(byte_at(memory, pc, 1), D_LOAD8_A, D_LOAD8_B);
+        d.imm = word_at(memory, pc, 2);
+        d.len = 4;
+        break;
+
+    case MEMCPY:
+        d.op = D_MEMCPY;
+        break;
+    case MEMSET:
+        d.op = D_MEMSET;
+        break;
+    case MEMCMP:
+        d.op = D_MEMCMP;
+        break;
+    case BANK:
+        d.op = D_BANK;
+        break;
+
+    case VLOAD:
+    case VSTORE:
+    case VSPLAT:
+    case VADD:
+    case VSUB:
+    case VAND:
+    case VOR:
+    case VXOR:
+    case VCMPEQ:
+    case VCMPGT:
+    case VSUM:
+    case VMIN:
+    case VMAX:
+    {
+        static_assert(D_VMAX - D_VLOAD == VMAX - VLOAD, "vector ops out of step with their opcodes");
+        bool pair = opcode >= VADD && opcode <= VCMPGT;
+        d.op = D_VLOAD + (opcode - VLOAD);
+        d.imm = byte_at(memory, pc, 1);
+        d.imm2 = pair ? byte_at(memory, pc, 2) : 0;
+        d.len = pair ? 3 : 2;
+        if (d.imm >= VECTOR_REGS || d.imm2 >= VECTOR_REGS)
+            d.op = D_NOP; // like an unknown scalar register
+        break;
+    }
+
+    case PUSH_A:
+        d.op = D_PUSH_A;
+        break;
+    case POP_A:
+        d.op = D_POP_A;
+        break;
+    case PUSH_B:
+        d.op = D_PUSH_B;
+        break;
+    case POP_B:
+        d.op = D_POP_B;
+        break;
+    case RET:
+        d.op = D_RET;
+        break;
+
+    case WAIT:
+        d.op = D_WAIT;
+        d.imm = byte_at(memory, pc, 1);
+        d.len = 2;
+        break;
+    case SYSCALL:
+        d.op = D_SYSCALL;
+        break;
+    case INT:
+        d.op = D_INT;
+        d.imm = byte_at(memory, pc, 1);
+        d.len = 2;
+        break;
+    case RESET:
+        d.op = D_RESET;
+        break;
+    case HLT:
+    case HALT:
+        d.op = D_HALT;
+        break;
+    default:
+        d.op = D_ILLEGAL;
+        d.imm = opcode;
+        break;
+    }
+}
+
+void decode_insn(VM &vm, uint16_t pc, DecodedInsn &d)
+{
+    decode_bytes(vm.memory, pc, d);
+    mark_decoded(vm, pc, d.len);
+}
+
+// Superinstructions: fixed sequences the assembler emits over and over,
+// folded into one record so they cost a single dispatch. Nothing that
+// stores is fused and a branch can only come last, so the guest sees
+// exactly the state the separate instructions would have produced. A jump
+// into the middle of a sequence lands on that address's own record.
+void decode_fused(VM &vm, uint16_t pc, DecodedInsn &d)
+{
+    DecodedInsn next, third;
+    decode_insn(vm, pc, d);
+    decode_insn(vm, (uint16_t)(pc + d.len), next);
+
+    switch (d.op)
+    {
+    case D_LD_A:
+        if (next.op == D_PRINT_CHAR)
+            d.op = D_LDA_PRINT_CHAR;
+        else if (next.op == D_PRINT_A)
+            d.op = D_LDA_PRINT_A;
+        else if (next.op == D_MUL)
+        {
+            decode_insn(vm, (uint16_t)(pc + d.len + next.len), third);
+            if (third.op != D_PRINT_A)
+                return;
+            d.op = D_LDA_MUL_PRINT_A;
+            d.len += third.len;
+            d.count++;
+        }
+        else
+            return;
+        break;
+    case D_MOV_A_B:
+        if (next.op != D_PRINT_A)
+            return;
+        d.op = D_MOV_A_B_PRINT_A;
+        break;
+    case D_INC_B:
+        if (next.op != D_JLT)
+            return;
+        d.op = D_INC_B_JLT;
+        d.imm = next.imm;
+        break;
+    case D_CMP:
+        if (next.op == D_JZ)
+            d.op = D_CMP_JZ;
+        else if (next.op == D_JNZ)
+            d.op = D_CMP_JNZ;
+        else
+            return;
+        d.imm = next.imm;
+        break;
+    default:
+        return;
+    }
+
+    d.len += next.len;
+    d.count++;
+    mark_decoded(vm, pc, d.len);
+}
+
+void invalidate_page(VM &vm, uint8_t page)
+{
+    // Records starting up to DECODE_MAX_SPAN - 1 bytes before the page may
+    // still cover some of its bytes
+    uint16_t first = (uint16_t)((page << VM_PAGE_SHIFT) - (DECODE_MAX_SPAN - 1));
+    for (int i = 0; i < VM_PAGE_SIZE + DECODE_MAX_SPAN - 1; i++)
+    {
+        vm.decode_cache[(uint16_t)(first + i)].handler = nullptr;
+    }
+    if (vm.page_flags[page] & PAGE_JIT)
+        jit_invalidate(vm);
+    vm.page_flags[page] &= ~PAGE_DECODED;
+}
+
+void decode_flush(VM &vm)
+{
+    for (int page = 0; page < VM_PAGE_COUNT; page++)
+    {
+        if (vm.page_flags[page] & PAGE_DECODED)
+            invalidate_page(vm, page);
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include "setup.h"
+
+class VM;
+
+// Guest memory is tracked in 256-byte pages for code invalidation
+#define VM_PAGE_SHIFT 8
+#define VM_PAGE_SIZE (1 << VM_PAGE_SHIFT)
+#define VM_PAGE_COUNT (0x10000 >> VM_PAGE_SHIFT)
+
+// page_flags bits
+#define PAGE_DECODED 0x01 // page holds bytes of a cached instruction
+#define PAGE_JIT 0x02     // page holds bytes of translated code
+#define PAGE_TRACK 0x04   // unchanged since VM::snapshot(); the next store logs it
+
+// Longest run of guest bytes a single cache record may cover
+#define DECODE_MAX_SPAN 16
+
+// Handler ids produced by the decoder. Instructions with a register operand
+// are split per register (and constant-address bounds checks are folded
+// away), so handlers never look at the 'a'/'b'/'c' byte or re-check operands.
+#define DECODED_OPS(X)                                                       \
+    X(NOP)                                                                   \
+    X(LD_A) X(LD_B) X(LD_C)                 /* reg = imm */                  \
+    X(MOV_A_B) X(MOV_B_A)                   /* a = b / b = a */              \
+    X(INC_A) X(INC_B) X(INC_C)                                               \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(MOD)                                       \
+    X(AND) X(OR) X(XOR) X(NOT) X(SHL) X(SHR)                                 \
+    X(PRINT_A) X(PRINT_R_A) X(PRINT_R_B) X(PRINT_R_C) X(PRINT_R_BAD)         \
+    X(PRINT_CHAR) X(IN_A)                                                    \
+    X(JMP) X(JZ) X(JNZ) X(JN) X(JP) X(JEQ) X(JGT) X(JLT) X(CMP)              \
+    X(LOAD8_A) X(LOAD8_B)                   /* reg = memory[imm] */          \
+    X(LOAD16_A) X(LOAD16_B)                 /* little-endian 16-bit load */  \
+    X(LOAD16BE_A)                           /* big-endian, LOAD_A_MEM */     \
+    X(STORE8_A)                             /* memory[imm] = a & 0xFF */     \
+    X(STORE16_A) X(STORE16_B)               /* little-endian 16-bit store */ \
+    X(STORE_IMM8) X(STORE_IMM16)            /* memory[imm] = imm2 */         \
+    X(MEMCPY) X(MEMSET) X(MEMCMP)           /* block ops on A, B and C */    \
+    X(BANK)                                 /* map bank A at BANK_WINDOW */  \
+    X(VLOAD) X(VSTORE) X(VSPLAT)            /* imm = vector register, */     \
+    X(VADD) X(VSUB) X(VAND) X(VOR) X(VXOR)  /* imm2 = second one; same */    \
+    X(VCMPEQ) X(VCMPGT)                     /* order as the opcodes */       \
+    X(VSUM) X(VMIN) X(VMAX)                                                  \
+    X(CALL) X(RET) X(PUSH_A) X(POP_A) X(PUSH_B) X(POP_B)                     \
+    X(WAIT) X(SYSCALL) X(INT) X(RESET) X(HALT)                               \
+    X(ILLEGAL)                              /* imm = raw opcode byte */      \
+    /* Superinstructions, only produced by decode_fused() */                 \
+    X(LDA_PRINT_CHAR) X(LDA_PRINT_A)        /* lda imm; printc|printa */     \
+    X(LDA_MUL_PRINT_A)                      /* lda imm; mul; printa */       \
+    X(MOV_A_B_PRINT_A)                      /* mov_reg_reg a b; printa */    \
+    X(INC_B_JLT)                            /* inc b; jlt imm */             \
+    X(CMP_JZ) X(CMP_JNZ)                    /* cmp; jz|jnz imm */
+
+enum DecodedOp : uint8_t
+{
+#define DECODED_OP_ENUM(name) D_##name,
+    DECODED_OPS(DECODED_OP_ENUM)
+#undef DECODED_OP_ENUM
+        D_COUNT
+};
+
+// One pre-decoded instruction, indexed by its guest address
+struct DecodedInsn
+{
+    const void *handler; // resolved dispatch target, nullptr when not decoded
+    uint16_t imm;        // immediate, address or branch target
+    uint16_t imm2;       // second operand (value of a memory-immediate store)
+    uint8_t op;          // DecodedOp
+    uint8_t len;         // guest bytes covered by this record
+    uint8_t count;       // guest instructions it retires (more than 1 if fused)
+    uint8_t pad;
+};
+
+// Fill `d` from the bytes at `pc`, touching nothing else; d.handler is
+// left alone. Also used to walk code outside a running VM (cfg.h).
+void decode_bytes(const uint8_t *memory, uint16_t pc, DecodedInsn &d);
+
+// Fill `d` from the guest bytes at `pc` and mark the pages it covers.
+// The caller resolves d.handler from d.op.
+void decode_insn(VM &vm, uint16_t pc, DecodedInsn &d);
+
+// Like decode_insn(), but folds a few common instruction sequences into a
+// single superinstruction record; used by the threaded interpreter
+void decode_fused(VM &vm, uint16_t pc, DecodedInsn &d);
+
+// Drop every cached record that covers bytes of `page`, and all native
+// translations if any of them came from it
+void invalidate_page(VM &vm, uint8_t page);
+
+// Drop the whole cache; used when memory changed behind the interpreter
+void decode_flush(VM &vm);
+
+#endif // DECODE_H
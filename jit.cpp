@@ -0,0 +1,955 @@
+#include "jit.h"
+#include "cpu.h"
+#include "decode.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+uint16_t jit_threshold = 16;
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE (8 << 20)
+#define JIT_MAX_BLOCK_INSNS 64
+#define JIT_MAX_BLOCK_BYTES 8192 // generous bound on one block plus its stubs
+#define JIT_SLICE 100000         // instructions between returns to the driver
+#define NEVER_TRANSLATE 0xFFFF   // hits[] marker for blocks the JIT can't start
+
+// Why native code returned to jit_execute()
+enum JitExit : uint32_t
+{
+    EXIT_BRANCH, // control reached a block that is not translated
+    EXIT_INTERP, // the instruction at pc must go through the interpreter
+    EXIT_BUDGET  // slice used up; lets the driver poll cpu_running
+};
+
+// Guest state as seen by native code, addressed through rbx
+struct JitContext
+{
+    uint16_t a, b, c, pc, sp;
+    uint16_t push_floor; // lowest sp a push may start from
+    uint16_t pop_ceiling; // highest sp a pop may start from
+    uint8_t zero_flag, negative_flag;
+    int64_t budget; // instructions native code may still retire
+    uint8_t *memory;
+    uint8_t *page_flags;
+    OutputBuffer *out;
+};
+
+// Host register numbers
+enum HostReg
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15
+};
+
+// Guest registers stay pinned in callee-saved host registers for the whole
+// time native code runs, so helper calls need no spilling
+static const int REG_A = R12, REG_B = R13, REG_C = R14;
+static const int REG_MEM = R15, REG_FLAGS = RBP, REG_CTX = RBX;
+
+// x86 condition codes
+enum Cond
+{
+    CC_B = 0x2,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7,
+    CC_L = 0xC
+};
+
+#define CTX(field) ((int32_t)offsetof(JitContext, field))
+
+// Minimal x86-64 encoder for the handful of forms the translator needs.
+// Memory operands are [base + disp32] or [base + index] with neither
+// register being rsp/r12, so SIB bytes only ever carry base and index.
+struct Emitter
+{
+    uint8_t *p;
+
+    void byte(uint8_t v) { *p++ = v; }
+    void word(uint16_t v)
+    {
+        std::memcpy(p, &v, 2);
+        p += 2;
+    }
+    void dword(uint32_t v)
+    {
+        std::memcpy(p, &v, 4);
+        p += 4;
+    }
+    void qword(uint64_t v)
+    {
+        std::memcpy(p, &v, 8);
+        p += 8;
+    }
+
+    void rex(bool w, int reg, int rm)
+    {
+        uint8_t r = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+        if (r != 0x40)
+            byte(r);
+    }
+    void modrm_reg(int reg, int rm) { byte(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+    void modrm_mem(int reg, int base, int32_t disp)
+    {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        dword(disp);
+    }
+    void rex_idx(int reg, int base, int index)
+    {
+        uint8_t r = 0x40 | ((reg & 8) ? 4 : 0) | ((index & 8) ? 2 : 0) | ((base & 8) ? 1 : 0);
+        if (r != 0x40)
+            byte(r);
+    }
+    void modrm_idx(int reg, int base, int index)
+    {
+        byte(0x84 | ((reg & 7) << 3)); // [base + index*1 + disp32]
+        byte(((index & 7) << 3) | (base & 7));
+        dword(0);
+    }
+
+    // op r/m16, r16 (add 01, or 09, and 21, sub 29, xor 31, cmp 39)
+    void alu16(uint8_t opc, int dst, int src)
+    {
+        byte(0x66);
+        rex(false, src, dst);
+        byte(opc);
+        modrm_reg(src, dst);
+    }
+    void imul16(int dst, int src)
+    {
+        byte(0x66);
+        rex(false, dst, src);
+        byte(0x0F);
+        byte(0xAF);
+        modrm_reg(dst, src);
+    }
+    // Group opcodes on a 16-bit register (inc FF/0, not F7/2, shl D1/4, shr D1/5)
+    void unary16(uint8_t opc, int ext, int r)
+    {
+        byte(0x66);
+        rex(false, 0, r);
+        byte(opc);
+        modrm_reg(ext, r);
+    }
+    void mov32_imm(int dst, uint32_t imm)
+    {
+        rex(false, 0, dst);
+        byte(0xB8 | (dst & 7));
+        dword(imm);
+    }
+    void mov32(int dst, int src)
+    {
+        rex(false, src, dst);
+        byte(0x89);
+        modrm_reg(src, dst);
+    }
+    void movzx16(int dst, int src)
+    {
+        rex(false, dst, src);
+        byte(0x0F);
+        byte(0xB7);
+        modrm_reg(dst, src);
+    }
+    void movzx8_mem(int dst, int base, int32_t disp)
+    {
+        rex(false, dst, base);
+        byte(0x0F);
+        byte(0xB6);
+        modrm_mem(dst, base, disp);
+    }
+    void movzx16_mem(int dst, int base, int32_t disp)
+    {
+        rex(false, dst, base);
+        byte(0x0F);
+        byte(0xB7);
+        modrm_mem(dst, base, disp);
+    }
+    void movzx16_idx(int dst, int base, int index)
+    {
+        rex_idx(dst, base, index);
+        byte(0x0F);
+        byte(0xB7);
+        modrm_idx(dst, base, index);
+    }
+    void load64(int dst, int base, int32_t disp)
+    {
+        rex(true, dst, base);
+        byte(0x8B);
+        modrm_mem(dst, base, disp);
+    }
+    void load8(int dst, int base, int32_t disp)
+    {
+        rex(false, dst, base);
+        byte(0x8A);
+        modrm_mem(dst, base, disp);
+    }
+    void or8(int dst, int base, int32_t disp)
+    {
+        rex(false, dst, base);
+        byte(0x0A);
+        modrm_mem(dst, base, disp);
+    }
+    void store8(int base, int32_t disp, int src)
+    {
+        rex(false, src, base);
+        byte(0x88);
+        modrm_mem(src, base, disp);
+    }
+    void store16(int base, int32_t disp, int src)
+    {
+        byte(0x66);
+        rex(false, src, base);
+        byte(0x89);
+        modrm_mem(src, base, disp);
+    }
+    void store16_idx(int base, int index, int src)
+    {
+        byte(0x66);
+        rex_idx(src, base, index);
+        byte(0x89);
+        modrm_idx(src, base, index);
+    }
+    void store8_imm(int base, int32_t disp, uint8_t imm)
+    {
+        rex(false, 0, base);
+        byte(0xC6);
+        modrm_mem(0, base, disp);
+        byte(imm);
+    }
+    void store16_imm(int base, int32_t disp, uint16_t imm)
+    {
+        byte(0x66);
+        rex(false, 0, base);
+        byte(0xC7);
+        modrm_mem(0, base, disp);
+        word(imm);
+    }
+    void cmp8_imm(int base, int32_t disp, uint8_t imm)
+    {
+        rex(false, 0, base);
+        byte(0x80);
+        modrm_mem(7, base, disp);
+        byte(imm);
+    }
+    void cmp8_imm_idx(int base, int index, uint8_t imm)
+    {
+        rex_idx(0, base, index);
+        byte(0x80);
+        modrm_idx(7, base, index);
+        byte(imm);
+    }
+    void cmp16_mem(int reg, int base, int32_t disp)
+    {
+        byte(0x66);
+        rex(false, reg, base);
+        byte(0x3B);
+        modrm_mem(reg, base, disp);
+    }
+    // Group 1/2 opcodes with an 8-bit immediate on a 32-bit register
+    // (add 83/0, sub 83/5, shr C1/5)
+    void imm8_32(uint8_t opc, int ext, int r, uint8_t imm)
+    {
+        rex(false, 0, r);
+        byte(opc);
+        modrm_reg(ext, r);
+        byte(imm);
+    }
+    void setcc(int cc, int base, int32_t disp)
+    {
+        rex(false, 0, base);
+        byte(0x0F);
+        byte(0x90 | cc);
+        modrm_mem(0, base, disp);
+    }
+    void add64_imm(int base, int32_t disp, int32_t imm)
+    {
+        rex(true, 0, base);
+        byte(0x81);
+        modrm_mem(0, base, disp);
+        dword(imm);
+    }
+    void sub64_imm(int base, int32_t disp, int32_t imm)
+    {
+        rex(true, 0, base);
+        byte(0x81);
+        modrm_mem(5, base, disp);
+        dword(imm);
+    }
+    void call(const void *fn)
+    {
+        byte(0x48); // mov rax, imm64
+        byte(0xB8);
+        qword((uint64_t)fn);
+        byte(0xFF); // call rax
+        byte(0xD0);
+    }
+    void push(int r)
+    {
+        rex(false, 0, r);
+        byte(0x50 | (r & 7));
+    }
+    void pop(int r)
+    {
+        rex(false, 0, r);
+        byte(0x58 | (r & 7));
+    }
+
+    // Branches return the address of their rel32 field for later patching
+    uint8_t *jcc(int cc)
+    {
+        byte(0x0F);
+        byte(0x80 | cc);
+        uint8_t *site = p;
+        dword(0);
+        return site;
+    }
+    uint8_t *jmp()
+    {
+        byte(0xE9);
+        uint8_t *site = p;
+        dword(0);
+        return site;
+    }
+};
+
+static void patch(uint8_t *site, const uint8_t *target)
+{
+    int32_t rel = (int32_t)(target - (site + 4));
+    std::memcpy(site, &rel, 4);
+}
+
+// Output helpers called from native code
+static void print_dec(uint16_t value, OutputBuffer *out) { out->put_dec(value); }
+static void print_char(uint16_t value, OutputBuffer *out) { out->put_char(value & 0xFF); }
+
+// A block exit that has not been linked to its target's translation yet
+struct ChainSlot
+{
+    uint16_t target;
+    uint8_t *site;
+};
+
+// Out-of-line exit path, emitted after the block body
+struct Stub
+{
+    uint8_t *site;
+    uint16_t pc;
+    int32_t refund; // instructions charged by the block but not executed
+    uint32_t reason;
+};
+
+// Per-VM translation state
+struct JitState
+{
+    uint8_t *code_buffer;
+    uint8_t *code_start; // first byte after the trampolines
+    uint8_t *code_end;   // next free byte
+    uint32_t (*enter_native)(JitContext *ctx, const void *block);
+    uint8_t *exit_native;
+
+    uint8_t **blocks; // translation entry per guest address
+    uint16_t *hits;   // block-entry counts per guest address
+    std::vector<ChainSlot> unchained;
+    std::vector<uint16_t> translated;
+};
+
+static JitState *jit_create()
+{
+    void *buffer = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        std::cerr << "JIT: could not map code buffer, interpreting only" << std::endl;
+        return nullptr;
+    }
+
+    JitState *jit = new JitState;
+    jit->code_buffer = (uint8_t *)buffer;
+    jit->blocks = (uint8_t **)calloc(0x10000, sizeof(uint8_t *));
+    jit->hits = (uint16_t *)calloc(0x10000, sizeof(uint16_t));
+
+    Emitter e = {jit->code_buffer};
+
+    // uint32_t enter_native(JitContext *ctx /* rdi */, const void *block /* rsi */)
+    jit->enter_native = (uint32_t(*)(JitContext *, const void *))e.p;
+    e.push(RBX);
+    e.push(RBP);
+    e.push(R12);
+    e.push(R13);
+    e.push(R14);
+    e.push(R15);
+    e.byte(0x48); // sub rsp, 8: keep helper calls 16-byte aligned
+    e.byte(0x83);
+    e.byte(0xEC);
+    e.byte(0x08);
+    e.byte(0x48); // mov rbx, rdi
+    e.byte(0x89);
+    e.byte(0xFB);
+    e.movzx16_mem(REG_A, REG_CTX, CTX(a));
+    e.movzx16_mem(REG_B, REG_CTX, CTX(b));
+    e.movzx16_mem(REG_C, REG_CTX, CTX(c));
+    e.load64(REG_MEM, REG_CTX, CTX(memory));
+    e.load64(REG_FLAGS, REG_CTX, CTX(page_flags));
+    e.byte(0xFF); // jmp rsi
+    e.byte(0xE6);
+
+    // Common exit: ctx->pc and eax (reason) are already set by the stub
+    jit->exit_native = e.p;
+    e.store16(REG_CTX, CTX(a), REG_A);
+    e.store16(REG_CTX, CTX(b), REG_B);
+    e.store16(REG_CTX, CTX(c), REG_C);
+    e.byte(0x48); // add rsp, 8
+    e.byte(0x83);
+    e.byte(0xC4);
+    e.byte(0x08);
+    e.pop(R15);
+    e.pop(R14);
+    e.pop(R13);
+    e.pop(R12);
+    e.pop(RBP);
+    e.pop(RBX);
+    e.byte(0xC3); // ret
+
+    jit->code_start = jit->code_end = e.p;
+    return jit;
+}
+
+void jit_destroy(JitState *jit)
+{
+    if (!jit)
+        return;
+    munmap(jit->code_buffer, JIT_BUFFER_SIZE);
+    free(jit->blocks);
+    free(jit->hits);
+    delete jit;
+}
+
+void jit_invalidate(VM &vm)
+{
+    JitState *jit = vm.jit;
+    if (!jit)
+        return;
+    for (uint16_t pc : jit->translated)
+        jit->blocks[pc] = nullptr;
+    jit->translated.clear();
+    jit->unchained.clear();
+    std::memset(jit->hits, 0, 0x10000 * sizeof(uint16_t));
+    for (int page = 0; page < VM_PAGE_COUNT; page++)
+        vm.page_flags[page] &= ~PAGE_JIT;
+    jit->code_end = jit->code_start;
+}
+
+// Whether the instruction can be translated. Anything that talks to the
+// host beyond plain output or changes the run state is left to the
+// interpreter, as are block memory operations, whose time goes on the
+// bytes they move, and vector operations, which keep their registers in
+// the VM. A 16-bit access at 0xFFFF needs no care: the byte after guest
+// memory maps memory[0].
+static bool translatable(const DecodedInsn &d)
+{
+    switch (d.op)
+    {
+    case D_IN_A:
+    case D_SYSCALL:
+    case D_INT:
+    case D_WAIT:
+    case D_HALT:
+    case D_RESET:
+    case D_ILLEGAL:
+    case D_PRINT_R_BAD:
+    case D_MEMCPY:
+    case D_MEMSET:
+    case D_MEMCMP:
+    case D_BANK:
+        return false;
+    default:
+        return d.op < D_VLOAD || d.op > D_VMAX;
+    }
+}
+
+static bool is_branch(uint8_t op)
+{
+    switch (op)
+    {
+    case D_JMP:
+    case D_JZ:
+    case D_JNZ:
+    case D_JN:
+    case D_JP:
+    case D_JEQ:
+    case D_JGT:
+    case D_JLT:
+    case D_CALL:
+    case D_RET:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Route a block exit to `target`: straight into its translation when there
+// is one, otherwise through a stub, remembering the site for later chaining
+static void chain(JitState &jit, uint8_t *site, uint16_t target, std::vector<Stub> &stubs)
+{
+    if (jit.blocks[target])
+    {
+        patch(site, jit.blocks[target]);
+        return;
+    }
+    Stub stub = {site, target, 0, EXIT_BRANCH};
+    stubs.push_back(stub);
+    ChainSlot slot = {target, site};
+    jit.unchained.push_back(slot);
+}
+
+// Bail out before a store when its page holds cached or translated code,
+// so the interpreter performs it and runs the invalidation
+static void guard_store(Emitter &e, uint16_t addr, int width, const Stub &bail, std::vector<Stub> &stubs)
+{
+    uint8_t first = addr >> VM_PAGE_SHIFT;
+    uint8_t last = (uint16_t)(addr + width - 1) >> VM_PAGE_SHIFT;
+    Stub stub = bail;
+    e.cmp8_imm(REG_FLAGS, first, 0);
+    stub.site = e.jcc(CC_NE);
+    stubs.push_back(stub);
+    if (last != first)
+    {
+        e.cmp8_imm(REG_FLAGS, last, 0);
+        stub.site = e.jcc(CC_NE);
+        stubs.push_back(stub);
+    }
+}
+
+// Stack slots are checked against the bounds in the context and, for
+// pushes, the page flags; any failure bails to the interpreter, which raises
+// the fault or performs the store. The slot pointer is left in rax. A slot
+// never straddles two pages since stack_top is even.
+static void emit_push(Emitter &e, int src, const Stub &bail, std::vector<Stub> &stubs)
+{
+    Stub stub = bail;
+    e.movzx16_mem(RAX, REG_CTX, CTX(sp));
+    e.cmp16_mem(RAX, REG_CTX, CTX(push_floor));
+    stub.site = e.jcc(CC_B);
+    stubs.push_back(stub);
+    e.imm8_32(0x83, 5, RAX, 2); // sub eax, 2
+    e.mov32(RCX, RAX);
+    e.imm8_32(0xC1, 5, RCX, VM_PAGE_SHIFT); // shr ecx, VM_PAGE_SHIFT
+    e.cmp8_imm_idx(REG_FLAGS, RCX, 0);
+    stub.site = e.jcc(CC_NE);
+    stubs.push_back(stub);
+    e.store16_idx(REG_MEM, RAX, src);
+    e.store16(REG_CTX, CTX(sp), RAX);
+}
+
+static void emit_pop(Emitter &e, int dst, const Stub &bail, std::vector<Stub> &stubs)
+{
+    Stub stub = bail;
+    e.movzx16_mem(RAX, REG_CTX, CTX(sp));
+    e.cmp16_mem(RAX, REG_CTX, CTX(pop_ceiling));
+    stub.site = e.jcc(CC_A);
+    stubs.push_back(stub);
+    e.movzx16_idx(dst, REG_MEM, RAX);
+    e.imm8_32(0x83, 0, RAX, 2); // add eax, 2
+    e.store16(REG_CTX, CTX(sp), RAX);
+}
+
+// helper(reg, ctx->out)
+static void emit_print(Emitter &e, int reg, const void *helper)
+{
+    e.movzx16(RDI, reg);
+    e.load64(RSI, REG_CTX, CTX(out));
+    e.call(helper);
+}
+
+static void emit_insn(Emitter &e, const DecodedInsn &d, const Stub &bail, std::vector<Stub> &stubs)
+{
+    switch (d.op)
+    {
+    case D_NOP:
+        break;
+    case D_LD_A:
+        e.mov32_imm(REG_A, d.imm);
+        break;
+    case D_LD_B:
+        e.mov32_imm(REG_B, d.imm);
+        break;
+    case D_LD_C:
+        e.mov32_imm(REG_C, d.imm);
+        break;
+    case D_MOV_A_B:
+        e.mov32(REG_A, REG_B);
+        break;
+    case D_MOV_B_A:
+        e.mov32(REG_B, REG_A);
+        break;
+    case D_INC_A:
+        e.unary16(0xFF, 0, REG_A);
+        break;
+    case D_INC_B:
+        e.unary16(0xFF, 0, REG_B);
+        break;
+    case D_INC_C:
+        e.unary16(0xFF, 0, REG_C);
+        break;
+
+    // 16-bit operand size gives the guest's wraparound for free
+    case D_ADD:
+        e.alu16(0x01, REG_A, REG_B);
+        break;
+    case D_SUB:
+        e.alu16(0x29, REG_A, REG_B);
+        break;
+    case D_AND:
+        e.alu16(0x21, REG_A, REG_B);
+        break;
+    case D_OR:
+        e.alu16(0x09, REG_A, REG_B);
+        break;
+    case D_XOR:
+        e.alu16(0x31, REG_A, REG_B);
+        break;
+    case D_MUL:
+        e.imul16(REG_A, REG_B);
+        break;
+    case D_NOT:
+        e.unary16(0xF7, 2, REG_A);
+        break;
+    case D_SHL:
+        e.unary16(0xD1, 4, REG_A);
+        break;
+    case D_SHR:
+        e.unary16(0xD1, 5, REG_A);
+        break;
+    case D_DIV:
+    case D_MOD:
+        e.movzx16(RAX, REG_A);
+        e.movzx16(RCX, REG_B);
+        e.byte(0x85); // test ecx, ecx
+        e.byte(0xC9);
+        e.byte(0x74); // jz over the division: A is left alone when B == 0
+        e.byte(0x07);
+        e.byte(0x31); // xor edx, edx
+        e.byte(0xD2);
+        e.byte(0xF7); // div ecx
+        e.byte(0xF1);
+        e.mov32(REG_A, d.op == D_DIV ? RAX : RDX);
+        break;
+
+    case D_PRINT_A:
+    case D_PRINT_R_A:
+        emit_print(e, REG_A, (const void *)print_dec);
+        break;
+    case D_PRINT_R_B:
+        emit_print(e, REG_B, (const void *)print_dec);
+        break;
+    case D_PRINT_R_C:
+        emit_print(e, REG_C, (const void *)print_dec);
+        break;
+    case D_PRINT_CHAR:
+        emit_print(e, REG_A, (const void *)print_char);
+        break;
+
+    case D_CMP:
+        e.alu16(0x39, REG_B, REG_C); // flags of B - C
+        e.setcc(CC_E, REG_CTX, CTX(zero_flag));
+        e.setcc(CC_B, REG_CTX, CTX(negative_flag));
+        break;
+
+    case D_LOAD8_A:
+        e.movzx8_mem(REG_A, REG_MEM, d.imm);
+        break;
+    case D_LOAD8_B:
+        e.movzx8_mem(REG_B, REG_MEM, d.imm);
+        break;
+    case D_LOAD16_A:
+        e.movzx16_mem(REG_A, REG_MEM, d.imm);
+        break;
+    case D_LOAD16_B:
+        e.movzx16_mem(REG_B, REG_MEM, d.imm);
+        break;
+    case D_LOAD16BE_A:
+        e.movzx16_mem(RAX, REG_MEM, d.imm);
+        e.byte(0x66); // rol ax, 8
+        e.byte(0xC1);
+        e.byte(0xC0);
+        e.byte(0x08);
+        e.mov32(REG_A, RAX);
+        break;
+
+    case D_STORE8_A:
+        guard_store(e, d.imm, 1, bail, stubs);
+        e.store8(REG_MEM, d.imm, REG_A);
+        break;
+    case D_STORE16_A:
+        guard_store(e, d.imm, 2, bail, stubs);
+        e.store16(REG_MEM, d.imm, REG_A);
+        break;
+    case D_STORE16_B:
+        guard_store(e, d.imm, 2, bail, stubs);
+        e.store16(REG_MEM, d.imm, REG_B);
+        break;
+    case D_STORE_IMM8:
+        guard_store(e, d.imm, 1, bail, stubs);
+        e.store8_imm(REG_MEM, d.imm, d.imm2 & 0xFF);
+        break;
+    case D_STORE_IMM16:
+        // High byte first in guest memory, so byte-swap for a host store
+        guard_store(e, d.imm, 2, bail, stubs);
+        e.store16_imm(REG_MEM, d.imm, (uint16_t)((d.imm2 >> 8) | (d.imm2 << 8)));
+        break;
+
+    case D_PUSH_A:
+        emit_push(e, REG_A, bail, stubs);
+        break;
+    case D_PUSH_B:
+        emit_push(e, REG_B, bail, stubs);
+        break;
+    case D_POP_A:
+        emit_pop(e, REG_A, bail, stubs);
+        break;
+    case D_POP_B:
+        emit_pop(e, REG_B, bail, stubs);
+        break;
+    }
+}
+
+static void emit_branch(JitState &jit, Emitter &e, const DecodedInsn &d, uint16_t next_pc,
+                        const Stub &bail, std::vector<Stub> &stubs)
+{
+    uint8_t *site;
+    switch (d.op)
+    {
+    case D_JMP:
+        chain(jit, e.jmp(), d.imm, stubs);
+        return;
+    case D_CALL:
+        e.mov32_imm(RDX, next_pc);
+        emit_push(e, RDX, bail, stubs);
+        chain(jit, e.jmp(), d.imm, stubs);
+        return;
+    case D_RET:
+        // Computed target: always leave through the driver, which looks
+        // the block up again
+        emit_pop(e, RCX, bail, stubs);
+        e.store16(REG_CTX, CTX(pc), RCX);
+        e.mov32_imm(RAX, EXIT_BRANCH);
+        patch(e.jmp(), jit.exit_native);
+        return;
+    case D_JZ:
+        e.cmp8_imm(REG_CTX, CTX(zero_flag), 0);
+        site = e.jcc(CC_NE);
+        break;
+    case D_JNZ:
+        e.cmp8_imm(REG_CTX, CTX(zero_flag), 0);
+        site = e.jcc(CC_E);
+        break;
+    case D_JN:
+        e.cmp8_imm(REG_CTX, CTX(negative_flag), 0);
+        site = e.jcc(CC_NE);
+        break;
+    case D_JP:
+        e.load8(RAX, REG_CTX, CTX(negative_flag));
+        e.or8(RAX, REG_CTX, CTX(zero_flag));
+        site = e.jcc(CC_E);
+        break;
+    case D_JEQ:
+        e.alu16(0x39, REG_B, REG_C);
+        site = e.jcc(CC_E);
+        break;
+    case D_JGT:
+        e.alu16(0x39, REG_B, REG_C);
+        site = e.jcc(CC_A);
+        break;
+    default: // D_JLT
+        e.alu16(0x39, REG_B, REG_C);
+        site = e.jcc(CC_B);
+        break;
+    }
+    chain(jit, site, d.imm, stubs);
+    chain(jit, e.jmp(), next_pc, stubs);
+}
+
+// Translate the block starting at `start`. Returns its entry point, or
+// nullptr when its first instruction has to be interpreted.
+static uint8_t *translate(VM &vm, uint16_t start)
+{
+    JitState &jit = *vm.jit;
+    DecodedInsn insns[JIT_MAX_BLOCK_INSNS];
+    uint16_t pcs[JIT_MAX_BLOCK_INSNS];
+    int count = 0;
+    uint16_t pc = start;
+    bool branch = false;
+
+    while (count < JIT_MAX_BLOCK_INSNS)
+    {
+        decode_insn(vm, pc, insns[count]);
+        if (!translatable(insns[count]))
+            break;
+        pcs[count++] = pc;
+        pc += insns[count - 1].len;
+        if (is_branch(insns[count - 1].op))
+        {
+            branch = true;
+            break;
+        }
+    }
+    if (count == 0)
+        return nullptr;
+
+    if (jit.code_buffer + JIT_BUFFER_SIZE - jit.code_end < JIT_MAX_BLOCK_BYTES)
+        jit_invalidate(vm);
+
+    Emitter e = {jit.code_end};
+    uint8_t *entry = e.p;
+    std::vector<Stub> stubs;
+
+    // Charge the whole block up front; if the slice can't cover it, leave
+    // before running anything
+    e.sub64_imm(REG_CTX, CTX(budget), count);
+    Stub head = {e.jcc(CC_L), start, count, EXIT_BUDGET};
+    stubs.push_back(head);
+
+    for (int i = 0; i < count; i++)
+    {
+        Stub bail = {nullptr, pcs[i], count - i, EXIT_INTERP};
+        if (branch && i == count - 1)
+            emit_branch(jit, e, insns[i], pc, bail, stubs);
+        else
+            emit_insn(e, insns[i], bail, stubs);
+
+        for (uint16_t byte = pcs[i]; byte != (uint16_t)(pcs[i] + insns[i].len); byte++)
+            vm.page_flags[byte >> VM_PAGE_SHIFT] |= PAGE_DECODED | PAGE_JIT;
+    }
+
+    if (!branch)
+    {
+        if (count == JIT_MAX_BLOCK_INSNS)
+            chain(jit, e.jmp(), pc, stubs); // split a long straight run
+        else
+        {
+            Stub interp = {e.jmp(), pc, 0, EXIT_INTERP};
+            stubs.push_back(interp);
+        }
+    }
+
+    for (const Stub &stub : stubs)
+    {
+        patch(stub.site, e.p);
+        e.store16_imm(REG_CTX, CTX(pc), stub.pc);
+        if (stub.refund)
+            e.add64_imm(REG_CTX, CTX(budget), stub.refund);
+        e.mov32_imm(RAX, stub.reason);
+        patch(e.jmp(), jit.exit_native);
+    }
+    jit.code_end = e.p;
+
+    jit.blocks[start] = entry;
+    jit.translated.push_back(start);
+
+    // Link earlier blocks that were waiting for this one
+    for (size_t i = 0; i < jit.unchained.size();)
+    {
+        if (jit.unchained[i].target == start)
+        {
+            patch(jit.unchained[i].site, entry);
+            jit.unchained[i] = jit.unchained.back();
+            jit.unchained.pop_back();
+        }
+        else
+            i++;
+    }
+    return entry;
+}
+
+bool jit_execute(VM &vm, uint64_t &budget)
+{
+    if (!vm.jit)
+    {
+        vm.jit = jit_create();
+        if (!vm.jit)
+        {
+            vm.dispatch_mode = DISPATCH_THREADED;
+            return false;
+        }
+    }
+    JitState &jit = *vm.jit;
+    CPU &cpu = vm.cpu;
+
+    uint16_t pc = cpu.pc;
+    uint8_t *block = jit.blocks[pc];
+    if (!block)
+    {
+        if (jit.hits[pc] == NEVER_TRANSLATE || ++jit.hits[pc] < jit_threshold)
+            return false;
+        block = translate(vm, pc);
+        if (!block)
+        {
+            jit.hits[pc] = NEVER_TRANSLATE;
+            return false;
+        }
+    }
+
+    JitContext ctx;
+    ctx.a = cpu.a;
+    ctx.b = cpu.b;
+    ctx.c = cpu.c;
+    ctx.pc = pc;
+    ctx.sp = cpu.sp;
+    ctx.push_floor = vm.stack_top - vm.stack_size + 2;
+    ctx.pop_ceiling = vm.stack_top - 2;
+    ctx.zero_flag = cpu.zero_flag;
+    ctx.negative_flag = cpu.negative_flag;
+    ctx.budget = std::min<uint64_t>(budget, JIT_SLICE);
+    int64_t slice = ctx.budget;
+    ctx.memory = vm.memory;
+    ctx.page_flags = vm.page_flags;
+    ctx.out = &vm.out;
+
+    uint32_t reason = jit.enter_native(&ctx, block);
+
+    cpu.a = ctx.a;
+    cpu.b = ctx.b;
+    cpu.c = ctx.c;
+    cpu.pc = ctx.pc;
+    cpu.sp = ctx.sp;
+    budget -= slice - ctx.budget; // the budget counts retired instructions
+    vm.cycles += slice - ctx.budget;
+    cpu.zero_flag = ctx.zero_flag;
+    cpu.negative_flag = ctx.negative_flag;
+    // A budget smaller than the first block leaves it to the interpreter,
+    // which can stop part way through
+    if (reason == EXIT_BUDGET && ctx.budget == slice)
+        return false;
+    return reason != EXIT_INTERP;
+}
+
+#else // !__x86_64__
+
+bool jit_execute(VM &, uint64_t &)
+{
+    return false;
+}
+
+void jit_invalidate(VM &)
+{
+}
+
+void jit_destroy(JitState *)
+{
+}
+
+#endif
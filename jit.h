@@ -0,0 +1,25 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "setup.h"
+
+class VM;
+struct JitState; // per-VM code buffer and block map, private to jit.cpp
+
+// Number of arrivals at a block entry before it is translated
+extern uint16_t jit_threshold;
+
+// Run translated code for the block at vm.cpu.pc, translating it first if
+// it just became hot, for at most `budget` instructions; the ones retired
+// are taken off `budget`. Returns false when the caller has to interpret
+// from vm.cpu.pc (cold block, or native code stopped at an instruction it
+// leaves to the interpreter).
+bool jit_execute(VM &vm, uint64_t &budget);
+
+// Drop every translation. Called when a store hits a translated page.
+void jit_invalidate(VM &vm);
+
+// Release vm.jit; accepts nullptr
+void jit_destroy(JitState *jit);
+
+#endif // JIT_H
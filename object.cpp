@@ -0,0 +1,202 @@
+#include "object.h"
+#include "cpu.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define OBJECT_HEADER_SIZE 20
+#define OBJECT_SECTION_SIZE 12
+
+static void put16(std::vector<uint8_t> &out, uint16_t value)
+{
+    out.push_back(value & 0xFF);
+    out.push_back(value >> 8);
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t value)
+{
+    put16(out, value & 0xFFFF);
+    put16(out, value >> 16);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint32_t align_up(uint32_t offset)
+{
+    return (offset + OBJECT_ALIGN - 1) & ~(uint32_t)(OBJECT_ALIGN - 1);
+}
+
+bool write_object(const std::string &path, const uint8_t *memory,
+                  const std::vector<ObjectSection> &sections, uint16_t entry,
+                  const SymbolTable &symbols)
+{
+    std::vector<uint8_t> symtab;
+    for (const auto &symbol : symbols)
+    {
+        size_t len = std::min<size_t>(symbol.first.size(), 255);
+        put16(symtab, symbol.second);
+        symtab.push_back(len);
+        symtab.insert(symtab.end(), symbol.first.begin(), symbol.first.begin() + len);
+    }
+
+    // Lay out the sections, each on its own aligned offset, then symbols
+    std::vector<uint32_t> offsets;
+    uint32_t offset = align_up(OBJECT_HEADER_SIZE + OBJECT_SECTION_SIZE * sections.size());
+    for (const auto &section : sections)
+    {
+        offsets.push_back(offset);
+        offset = align_up(offset + section.size);
+    }
+
+    std::vector<uint8_t> file(OBJECT_MAGIC, OBJECT_MAGIC + 4);
+    put16(file, OBJECT_VERSION);
+    put16(file, entry);
+    put16(file, sections.size());
+    put16(file, 0);
+    put32(file, symtab.empty() ? 0 : offset);
+    put32(file, symtab.size());
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+        put16(file, sections[i].addr);
+        put16(file, sections[i].kind);
+        put32(file, sections[i].size);
+        put32(file, offsets[i]);
+    }
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+        file.resize(offsets[i], 0);
+        file.insert(file.end(), memory + sections[i].addr, memory + sections[i].addr + sections[i].size);
+    }
+    file.resize(offset, 0);
+    file.insert(file.end(), symtab.begin(), symtab.end());
+
+    std::ofstream out(path, std::ios::binary);
+    out.write((const char *)file.data(), file.size());
+    if (!out)
+    {
+        std::cerr << "Error: Could not write object file " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool read_at(int fd, uint8_t *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pread(fd, buf + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// Read and check the header and section table of an open object file.
+// Returns what is wrong with it, or "" if nothing is.
+static std::string read_header(int fd, off_t file_size, uint16_t &entry,
+                               std::vector<std::pair<ObjectSection, uint32_t>> &sections,
+                               uint32_t &symbols_offset, uint32_t &symbols_size)
+{
+    uint8_t header[OBJECT_HEADER_SIZE];
+    if (!read_at(fd, header, sizeof(header), 0) || std::memcmp(header, OBJECT_MAGIC, 4) != 0)
+        return "not a HexaVM object file";
+    if (get16(header + 4) != OBJECT_VERSION)
+        return "unsupported format version " + std::to_string(get16(header + 4));
+    entry = get16(header + 6);
+    symbols_offset = get32(header + 12);
+    symbols_size = get32(header + 16);
+    if ((off_t)symbols_offset + symbols_size > file_size)
+        return "symbol table past the end of the file";
+
+    std::vector<uint8_t> table(OBJECT_SECTION_SIZE * get16(header + 8));
+    if (!read_at(fd, table.data(), table.size(), OBJECT_HEADER_SIZE))
+        return "truncated section table";
+    for (size_t pos = 0; pos < table.size(); pos += OBJECT_SECTION_SIZE)
+    {
+        ObjectSection section = {get16(&table[pos]), get16(&table[pos + 2]), get32(&table[pos + 4])};
+        uint32_t offset = get32(&table[pos + 8]);
+        if (section.addr + section.size > ADDRESS_SPACE || (off_t)offset + section.size > file_size ||
+            offset % OBJECT_ALIGN != 0)
+            return "bad section at address " + std::to_string(section.addr);
+        sections.push_back(std::make_pair(section, offset));
+    }
+    return "";
+}
+
+static void read_symbols(const std::vector<uint8_t> &symtab, SymbolTable &symbols)
+{
+    size_t pos = 0;
+    while (pos + 3 <= symtab.size() && pos + 3 + symtab[pos + 2] <= symtab.size())
+    {
+        uint8_t len = symtab[pos + 2];
+        symbols[std::string(symtab.begin() + pos + 3, symtab.begin() + pos + 3 + len)] = get16(&symtab[pos]);
+        pos += 3 + len;
+    }
+}
+
+bool load_object(VM &vm, const std::string &path, SymbolTable *symbols, std::vector<ObjectSection> *loaded)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Error: Could not open object file " << path << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    uint16_t entry = 0;
+    std::vector<std::pair<ObjectSection, uint32_t>> sections;
+    uint32_t symbols_offset = 0, symbols_size = 0;
+    std::string error = fstat(fd, &st) != 0 ? "cannot stat file"
+                                            : read_header(fd, st.st_size, entry, sections, symbols_offset, symbols_size);
+
+    // Mapping a section zeroes the rest of its last page, so sections that
+    // start on a page go in first and the rest are copied over them
+    std::stable_sort(sections.begin(), sections.end(),
+                     [](const std::pair<ObjectSection, uint32_t> &x, const std::pair<ObjectSection, uint32_t> &y)
+                     { return x.first.addr % OBJECT_ALIGN == 0 && y.first.addr % OBJECT_ALIGN != 0; });
+    for (size_t i = 0; i < sections.size() && error.empty(); i++)
+    {
+        if (!vm.load_region(fd, sections[i].second, sections[i].first.size, sections[i].first.addr))
+            error = "cannot read section at address " + std::to_string(sections[i].first.addr);
+    }
+
+    if (error.empty() && symbols && symbols_size)
+    {
+        std::vector<uint8_t> symtab(symbols_size);
+        if (read_at(fd, symtab.data(), symtab.size(), symbols_offset))
+            read_symbols(symtab, *symbols);
+        else
+            error = "cannot read symbol table";
+    }
+    close(fd);
+
+    if (!error.empty())
+    {
+        std::cerr << "Error: " << path << ": " << error << std::endl;
+        return false;
+    }
+    if (loaded)
+    {
+        for (const auto &section : sections)
+            loaded->push_back(section.first);
+    }
+    vm.instruction_base = entry;
+    vm.cpu.pc = entry;
+    return true;
+}
@@ -0,0 +1,62 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include "setup.h"
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+class VM;
+
+// HexaVM object file (.hxo), all fields little-endian:
+//
+//   0   char[4]  magic "HXVM"
+//   4   u16      format version, OBJECT_VERSION
+//   6   u16      entry point
+//   8   u16      number of sections
+//   10  u16      reserved, 0
+//   12  u32      file offset of the symbol table, 0 if there is none
+//   16  u32      size of the symbol table in bytes
+//   20           section table: per section u16 load address, u16 kind,
+//                u32 size, u32 file offset
+//
+// Section contents start at OBJECT_ALIGN-aligned file offsets and are
+// zero-padded to the next one, so a loader can map them into guest memory
+// as they are. Symbol table entries are u16 address, u8 name length, name.
+#define OBJECT_MAGIC "HXVM"
+#define OBJECT_VERSION 1
+#define OBJECT_ALIGN 4096
+
+enum SectionKind : uint16_t
+{
+    SECTION_CODE = 1, // instructions
+    SECTION_DATA = 2  // .db bytes
+};
+
+// Label name -> address. Compares transparently, so it can be searched
+// with a std::string_view without building a std::string.
+typedef std::map<std::string, uint16_t, std::less<>> SymbolTable;
+
+// A run of guest memory the assembler emitted
+struct ObjectSection
+{
+    uint16_t addr;
+    uint16_t kind;
+    uint32_t size;
+};
+
+// Write `sections` of `memory` to `path` as an object file. Reports on
+// stderr and returns false on failure.
+bool write_object(const std::string &path, const uint8_t *memory,
+                  const std::vector<ObjectSection> &sections, uint16_t entry,
+                  const SymbolTable &symbols);
+
+// Load an object file into vm and point it at the entry. Symbols are added
+// to `symbols` and the section table to `loaded` when they are not null.
+// Reports on stderr and returns false if the file is not a valid object of
+// this version or does not fit.
+bool load_object(VM &vm, const std::string &path, SymbolTable *symbols,
+                 std::vector<ObjectSection> *loaded = nullptr);
+
+#endif // OBJECT_H
@@ -0,0 +1,87 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#define OUTPUT_BUFFER_SIZE 16384
+
+// Guest output (PRINT_*, SYSCALL 0x02-0x05, INT 0x10/0x11) for one VM.
+// Characters and numbers are appended to a fixed buffer and handed to the
+// kernel in one write() when it fills up, when the guest stops, or before
+// the guest reads input; iostreams are never involved.
+class OutputBuffer
+{
+public:
+    int fd = STDOUT_FILENO; // where flush() writes
+
+    ~OutputBuffer() { flush(); }
+
+    void put_char(char c)
+    {
+        if (len == sizeof(buf))
+            flush();
+        buf[len++] = c;
+    }
+
+    // Unsigned decimal, at most five digits
+    void put_dec(uint16_t value)
+    {
+        if (sizeof(buf) - len < 5)
+            flush();
+        char digits[5];
+        int n = 0;
+        do
+        {
+            digits[n++] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        while (n)
+            buf[len++] = digits[--n];
+    }
+
+    // A run of bytes; one too big for the buffer goes to the kernel as is
+    void put_bytes(const void *data, size_t size)
+    {
+        if (size > sizeof(buf) - len)
+        {
+            flush();
+            if (size >= sizeof(buf))
+            {
+                write_all(data, size);
+                return;
+            }
+        }
+        std::memcpy(buf + len, data, size);
+        len += size;
+    }
+
+    void flush()
+    {
+        write_all(buf, len);
+        len = 0;
+    }
+
+private:
+    void write_all(const void *data, size_t size)
+    {
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t n = ::write(fd, (const char *)data + done, size - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break; // nowhere to put it; drop the rest
+            done += n;
+        }
+    }
+
+    char buf[OUTPUT_BUFFER_SIZE];
+    size_t len = 0;
+};
+
+#endif // OUTPUT_H
@@ -0,0 +1,185 @@
+#include "profile.h"
+#include "assembler.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+Profile::Profile(uint16_t entry)
+    : pc_count(0x10000), taken_count(0x10000), not_taken(0x10000)
+{
+    Frame root = {entry, 0, 0, {}};
+    frames.push_back(root);
+}
+
+void Profile::enter(uint16_t func)
+{
+    auto child = frames[current].children.find(func);
+    if (child != frames[current].children.end())
+    {
+        current = child->second;
+        return;
+    }
+    Frame frame = {func, current, 0, {}};
+    frames.push_back(frame);
+    uint32_t index = frames.size() - 1;
+    frames[current].children[func] = index;
+    current = index;
+}
+
+// Address -> nearest label at or below it
+class LabelMap
+{
+public:
+    explicit LabelMap(const TextAssembler &assembler)
+    {
+        for (const auto &symbol : assembler.symbols())
+            labels.push_back(std::make_pair(symbol.second, symbol.first));
+        std::sort(labels.begin(), labels.end());
+    }
+
+    // Label the address falls under, or its own hex form if none does
+    std::string block(uint16_t addr) const
+    {
+        auto it = find(addr);
+        return it == labels.end() ? hex(addr) : it->second;
+    }
+
+    // "label+offset", or hex when no label precedes the address
+    std::string locate(uint16_t addr) const
+    {
+        auto it = find(addr);
+        if (it == labels.end())
+            return hex(addr);
+        if (it->first == addr)
+            return it->second;
+        return it->second + "+" + std::to_string(addr - it->first);
+    }
+
+    // A function's name: its label when one sits exactly on it
+    std::string function(uint16_t addr) const
+    {
+        auto it = find(addr);
+        return it != labels.end() && it->first == addr ? it->second : hex(addr);
+    }
+
+    static std::string hex(uint16_t addr)
+    {
+        std::ostringstream s;
+        s << "0x" << std::hex << std::setw(4) << std::setfill('0') << addr;
+        return s.str();
+    }
+
+private:
+    std::vector<std::pair<uint16_t, std::string>>::const_iterator find(uint16_t addr) const
+    {
+        auto it = std::upper_bound(labels.begin(), labels.end(),
+                                   std::make_pair(addr, std::string("\xff")));
+        return it == labels.begin() ? labels.end() : it - 1;
+    }
+
+    std::vector<std::pair<uint16_t, std::string>> labels;
+};
+
+static std::string percent(uint64_t part, uint64_t total)
+{
+    std::ostringstream s;
+    s << std::fixed << std::setprecision(1) << (total ? 100.0 * part / total : 0.0) << "%";
+    return s.str();
+}
+
+static std::string opcode_name(const TextAssembler &assembler, uint8_t opcode)
+{
+    std::string name = assembler.mnemonic(opcode);
+    if (name.empty())
+    {
+        std::ostringstream s;
+        s << "op_0x" << std::hex << std::setw(2) << std::setfill('0') << (int)opcode;
+        name = s.str();
+    }
+    return name;
+}
+
+void Profile::write_report(std::ostream &out, const TextAssembler &assembler) const
+{
+    const size_t hot_addresses = 20;
+    LabelMap labels(assembler);
+
+    uint64_t total = 0;
+    for (uint64_t count : op_count)
+        total += count;
+    out << "Instructions retired: " << total << "\n";
+
+    // Blocks: the code between one label and the next
+    std::map<std::string, uint64_t> blocks;
+    std::vector<std::pair<uint64_t, uint16_t>> hot;
+    for (uint32_t addr = 0; addr < 0x10000; addr++)
+    {
+        if (!pc_count[addr])
+            continue;
+        blocks[labels.block(addr)] += pc_count[addr];
+        hot.push_back(std::make_pair(pc_count[addr], (uint16_t)addr));
+    }
+    std::vector<std::pair<uint64_t, std::string>> by_count;
+    for (const auto &block : blocks)
+        by_count.push_back(std::make_pair(block.second, block.first));
+    std::sort(by_count.rbegin(), by_count.rend());
+
+    out << "\nBlocks\n";
+    out << std::setw(14) << "count" << std::setw(8) << "share" << "  label\n";
+    for (const auto &block : by_count)
+        out << std::setw(14) << block.first << std::setw(8) << percent(block.first, total)
+            << "  " << block.second << "\n";
+
+    std::sort(hot.rbegin(), hot.rend());
+    if (hot.size() > hot_addresses)
+        hot.resize(hot_addresses);
+    out << "\nHottest addresses\n";
+    out << std::setw(14) << "count" << std::setw(8) << "share" << "  address  location\n";
+    for (const auto &entry : hot)
+        out << std::setw(14) << entry.first << std::setw(8) << percent(entry.first, total)
+            << "  " << LabelMap::hex(entry.second) << "   " << labels.locate(entry.second) << "\n";
+
+    out << "\nBranches\n";
+    out << std::setw(14) << "taken" << std::setw(14) << "not taken" << "  address  location\n";
+    for (uint32_t addr = 0; addr < 0x10000; addr++)
+    {
+        if (!taken_count[addr] && !not_taken[addr])
+            continue;
+        out << std::setw(14) << taken_count[addr] << std::setw(14) << not_taken[addr]
+            << "  " << LabelMap::hex(addr) << "   " << labels.locate(addr) << "\n";
+    }
+
+    std::vector<std::pair<uint64_t, int>> ops;
+    for (int op = 0; op < 256; op++)
+    {
+        if (op_count[op])
+            ops.push_back(std::make_pair(op_count[op], op));
+    }
+    std::sort(ops.rbegin(), ops.rend());
+    out << "\nOpcodes\n";
+    out << std::setw(14) << "count" << std::setw(8) << "share" << "  opcode\n";
+    for (const auto &op : ops)
+        out << std::setw(14) << op.first << std::setw(8) << percent(op.first, total)
+            << "  " << opcode_name(assembler, op.second) << "\n";
+}
+
+void Profile::write_folded(std::ostream &out, const TextAssembler &assembler) const
+{
+    LabelMap labels(assembler);
+
+    // Walk the call tree depth first, carrying the path so far
+    std::vector<std::pair<uint32_t, std::string>> pending;
+    pending.push_back(std::make_pair(0u, labels.function(frames[0].func)));
+    while (!pending.empty())
+    {
+        uint32_t index = pending.back().first;
+        std::string path = pending.back().second;
+        pending.pop_back();
+
+        const Frame &frame = frames[index];
+        if (frame.self)
+            out << path << " " << frame.self << "\n";
+        for (const auto &child : frame.children)
+            pending.push_back(std::make_pair(child.second, path + ";" + labels.function(child.first)));
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "setup.h"
+#include <map>
+#include <ostream>
+#include <vector>
+
+class TextAssembler;
+
+// Execution profile gathered by the switch interpreter while VM::profile is
+// set: retired instructions per opcode and per address, taken/not-taken
+// counts for every branch and call, and instruction counts per call stack.
+class Profile
+{
+public:
+    // `entry` names the outermost stack frame
+    explicit Profile(uint16_t entry);
+
+    // Account for the instruction at `pc`, which left the PC at `next_pc`.
+    // `taken` says whether a branch, call or return went to its target; a
+    // CALL or RET that faulted did not, and leaves the call stack alone.
+    void record(uint16_t pc, uint8_t opcode, uint16_t next_pc, bool taken)
+    {
+        op_count[opcode]++;
+        pc_count[pc]++;
+        frames[current].self++;
+        switch (opcode)
+        {
+        case JMP:
+        case JZ:
+        case JNZ:
+        case JN:
+        case JP:
+        case JEQ:
+        case JGT:
+        case JLT:
+            if (taken)
+                taken_count[pc]++;
+            else
+                not_taken[pc]++;
+            break;
+        case CALL:
+            if (taken)
+            {
+                taken_count[pc]++;
+                enter(next_pc);
+            }
+            else
+                not_taken[pc]++;
+            break;
+        case RET:
+            if (current != 0 && taken)
+                current = frames[current].parent;
+            break;
+        }
+    }
+
+    // Human-readable summary: hottest labelled blocks, addresses, branches
+    // and opcodes, with addresses shown as label+offset
+    void write_report(std::ostream &out, const TextAssembler &assembler) const;
+
+    // One "outer;inner;leaf count" line per call stack, the input format of
+    // flamegraph.pl and compatible tools
+    void write_folded(std::ostream &out, const TextAssembler &assembler) const;
+
+private:
+    // Node of the call tree; the root (index 0) is the entry frame
+    struct Frame
+    {
+        uint16_t func;
+        uint32_t parent;
+        uint64_t self; // instructions retired directly in this frame
+        std::map<uint16_t, uint32_t> children;
+    };
+
+    void enter(uint16_t func);
+
+    uint64_t op_count[256] = {};
+    std::vector<uint64_t> pc_count, taken_count, not_taken; // indexed by address
+    std::vector<Frame> frames;
+    uint32_t current = 0;
+};
+
+#endif // PROFILE_H
@@ -1,21 +1,28 @@
 #include "setup.h"
 #include "cpu.h"
 #include "assembler.h"
-#include <cstring> // For std::memset
-
-// Function to reset memory to all zeros
-void clearMemory()
-{
-    std::memset(memory, 0, MEMORY_MAX);
-}
+#include "profile.h"
+#include "object.h"
+#include "cfg.h"
+#include "aot.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <chrono>
+#include <fcntl.h>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <thread>
 
 // Function to run the assembled program on the CPU
-void runProgram()
+void runProgram(VM &vm)
 {
+    const CPU &cpu = vm.cpu;
 
     // Print initial state
     std::cout << "\nRunning program...\n";
-    std::cout << "Initial CPU state: PC=" << cpu.pc
+    std::cout << "Initial CPU state: PC=0x" << std::hex << cpu.pc << std::dec
               << ", A=" << cpu.a << ", B=" << cpu.b << ", C=" << cpu.c << std::endl;
 
     // Execute the program
@@ -24,27 +31,225 @@ void runProgram()
     // std::cout << std::dec;
 
     // Main execution loop is in the cpu.cpp file's main function
-    start();
+    vm.start();
 
     std::cout << "\n----------------------------------------\n";
     std::cout << "Program terminated.\n";
-    std::cout << "Final CPU state: PC=" << cpu.pc
+    std::cout << "Final CPU state: PC=0x" << std::hex << cpu.pc << std::dec
               << ", A=" << cpu.a << ", B=" << cpu.b << ", C=" << cpu.c << std::endl;
+    std::cout << "Cycles: " << vm.cycles << std::endl;
+}
+
+// Private (unshared) host memory of this process in KB, from
+// /proc/self/smaps_rollup, or -1 if the kernel does not report it
+static long privateMemoryKB()
+{
+    std::ifstream rollup("/proc/self/smaps_rollup");
+    std::string line;
+    long total = -1;
+    while (std::getline(rollup, line))
+    {
+        if (line.compare(0, 8, "Private_") == 0)
+            total = std::max(total, 0L) + std::strtol(line.c_str() + line.find(':') + 1, nullptr, 10);
+    }
+    return total;
+}
+
+// Run `count` instances of the program loaded in `vm`, each a new VM with
+// its settings that maps one SharedImage of `sections`. They run one after
+// another, so only the first reads stdin and its run is reported as usual;
+// the others write their output to /dev/null. All are kept until the last
+// has finished, then the private host memory they took is reported per
+// instance, with how many ended in a different state from the first.
+static bool runInstances(const VM &vm, const std::vector<ObjectSection> &sections, unsigned count)
+{
+    std::unique_ptr<SharedImage> image;
+    try
+    {
+        image.reset(new SharedImage(vm, sections));
+    }
+    catch (const std::bad_alloc &)
+    {
+        std::cerr << "Error: Could not create a shared image of the program" << std::endl;
+        return false;
+    }
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devNull < 0)
+    {
+        std::cerr << "Error: Could not open /dev/null" << std::endl;
+        return false;
+    }
+
+    long before = privateMemoryKB();
+    std::vector<std::unique_ptr<VM>> instances;
+    unsigned differing = 0;
+    bool ok = true;
+    for (unsigned i = 0; i < count && ok; i++)
+    {
+        instances.emplace_back(new VM);
+        VM &instance = *instances.back();
+        instance.stack_size = vm.stack_size;
+        instance.dispatch_mode = vm.dispatch_mode;
+        instance.wait_mode = vm.wait_mode;
+        ok = instance.set_banks(vm.bank_count) && instance.map_image(*image);
+        if (!ok)
+            break;
+        if (i == 0)
+        {
+            runProgram(instance);
+            continue;
+        }
+        instance.out.fd = devNull;
+        instance.start();
+        const VM &first = *instances.front();
+        if (instance.cpu.pc != first.cpu.pc || instance.cpu.a != first.cpu.a || instance.cpu.b != first.cpu.b ||
+            instance.cpu.c != first.cpu.c || instance.cycles != first.cycles || instance.status != first.status)
+            differing++;
+    }
+    long after = privateMemoryKB();
+    if (ok)
+    {
+        std::cout << "\nInstances: " << count << " from a shared image, " << differing
+                  << " ended differently from the first" << std::endl;
+        if (before >= 0 && after >= 0)
+            std::cout << "Private memory: " << (after - before) / count << " KB per instance" << std::endl;
+    }
+
+    instances.clear(); // flushes their output, before /dev/null is closed
+    close(devNull);
+    return ok;
+}
+
+static bool hasSuffix(const std::string &name, const std::string &suffix)
+{
+    return name.size() >= suffix.size() &&
+           name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Save the assembled program to outputFile, or hex dump it when there is none
+static void saveOutput(TextAssembler &assembler, const std::string &outputFile)
+{
+    // Determine start and end addresses
+    uint16_t start = 0x9000; // Default
+    uint16_t end = 0x9000;   // Will be updated
+
+    // End after the highest byte the assembler emitted
+    for (const auto &section : assembler.sections())
+    {
+        end = std::max<uint32_t>(end, section.addr + section.size);
+    }
+
+    // Either save to file or print hex dump
+    if (hasSuffix(outputFile, ".hxo"))
+    {
+        if (assembler.saveObject(outputFile))
+        {
+            std::cout << "Object file saved to " << outputFile << std::endl;
+            std::cout << "Sections: " << assembler.sections().size() << ", entry 0x"
+                      << std::hex << assembler.entry() << std::dec << std::endl;
+        }
+    }
+    else if (!outputFile.empty())
+    {
+        if (assembler.saveToFile(outputFile, start, end))
+        {
+            std::cout << "Binary output saved to " << outputFile << std::endl;
+            std::cout << "Size: " << (end - start) << " bytes" << std::endl;
+        }
+    }
+    else
+    {
+        std::cout << "Assembly result:" << std::endl;
+        assembler.hexDump(start, end);
+    }
+}
+
+// Assemble inputFile again every time it changes, patching only what the
+// edit touched, and keep outputFile up to date. With `run`, the program is
+// run from the same starting memory after each rebuild. Never returns.
+static void watchProgram(VM &vm, const std::string &inputFile, const std::string &outputFile, bool run)
+{
+    vm.clearMemory();
+    IncrementalAssembler incremental(vm.memory);
+    TextAssembler &program = incremental.program();
+    struct timespec seenTime = {};
+    off_t seenSize = -1;
+    bool snapshotTaken = false;
+    while (true)
+    {
+        struct stat st;
+        if (stat(inputFile.c_str(), &st) != 0 ||
+            (st.st_mtim.tv_sec == seenTime.tv_sec && st.st_mtim.tv_nsec == seenTime.tv_nsec && st.st_size == seenSize))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        seenTime = st.st_mtim;
+        seenSize = st.st_size;
+        SourceFile source;
+        if (!source.open(inputFile))
+            continue;
+
+        // Back to the memory the last build left, before the last run
+        if (snapshotTaken)
+            vm.restore();
+        auto begin = std::chrono::steady_clock::now();
+        const IncrementalAssembler::Stats &stats = incremental.update(source.text());
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+        std::cout << "Assembled " << inputFile << " in " << elapsed.count() << " us: " << stats.lines << " lines, "
+                  << stats.parsed << " parsed, " << stats.reencoded << " re-encoded, " << stats.rewritten << " rewritten"
+                  << (stats.full ? " (overlapping .org, full rewrite)" : "") << std::endl;
+        if (!outputFile.empty())
+            saveOutput(program, outputFile);
+
+        if (run)
+        {
+            vm.instruction_base = program.entry();
+            vm.cpu.pc = vm.instruction_base;
+            vm.snapshot();
+            snapshotTaken = true;
+            std::cout << "\n===================================\n";
+            runProgram(vm);
+        }
+        std::cout << "\nWatching " << inputFile << " for changes..." << std::endl;
+    }
 }
 
 int main(int argc, char **argv)
 {
     if (argc < 2)
     {
-        std::cout << "Usage: " << argv[0] << " <input.asm> [-r] [output.bin]" << std::endl;
+        std::cout << "Usage: " << argv[0] << " <input.asm> [-r] [-b addr] [-e addr] [-d mode] [-s bytes] [-m banks] [-p file] [-t clock] [-j threads] [-n count] [-w] [-O] [-a file.cpp] [output.bin]" << std::endl;
         std::cout << "  -r         : Run the program after assembling" << std::endl;
-        std::cout << "  output.bin : Save assembled binary to file (optional)" << std::endl;
+        std::cout << "  -b addr    : Input is a binary image; load it at addr and run it" << std::endl;
+        std::cout << "  -e addr    : Entry point of a binary image (default: its load address)" << std::endl;
+        std::cout << "  -d mode    : Execution engine: 'switch' (default), 'threaded' or 'jit'" << std::endl;
+        std::cout << "  -s bytes   : Stack size, even (default 0x400)" << std::endl;
+        std::cout << "  -m banks   : Number of 16 KB memory banks the guest can map at 0x4000 (default 1)" << std::endl;
+        std::cout << "  -p file    : Profile the run (switch loop); report to file, stacks to file.folded" << std::endl;
+        std::cout << "  -t clock   : 'real' waits sleep (default), 'virtual' waits only advance the clock" << std::endl;
+        std::cout << "  -j threads : Assemble large sources on this many threads (default 1)" << std::endl;
+        std::cout << "  -n count   : Run count instances of the program from one shared image; report memory per instance" << std::endl;
+        std::cout << "  -w         : Watch the source; reassemble (and rerun) only what changed on each save" << std::endl;
+        std::cout << "  -O         : Remove wasted and unreachable instructions before assembling" << std::endl;
+        std::cout << "  -a file    : Translate the program to a standalone C++ file instead of running it" << std::endl;
+        std::cout << "  output.bin : Save assembled binary to file (optional); a .hxo name writes an object file" << std::endl;
         return 1;
     }
 
     std::string inputFile = argv[1];
     bool runAfterAssembly = false;
     std::string outputFile = "";
+    std::string profileFile = "";
+    bool binaryInput = false;
+    uint16_t loadAddress = 0;
+    long entry = -1;
+    unsigned threads = 1;
+    unsigned instances = 1;
+    bool watch = false;
+    bool optimise = false;
+    std::string aotFile = "";
+    VM vm;
 
     // Parse command line arguments
     for (int i = 2; i < argc; i++)
@@ -54,59 +259,246 @@ int main(int argc, char **argv)
         {
             runAfterAssembly = true;
         }
+        else if ((arg == "-b" || arg == "-e") && i + 1 < argc)
+        {
+            unsigned long addr = std::strtoul(argv[++i], nullptr, 0);
+            if (addr > MEMORY_MAX)
+            {
+                std::cerr << "Error: Address must be at most 0x" << std::hex << MEMORY_MAX << std::endl;
+                return 1;
+            }
+            if (arg == "-b")
+            {
+                binaryInput = true;
+                loadAddress = addr;
+            }
+            else
+            {
+                entry = addr;
+            }
+        }
+        else if (arg == "-d" && i + 1 < argc)
+        {
+            std::string mode = argv[++i];
+            if (mode == "switch")
+                vm.dispatch_mode = DISPATCH_SWITCH;
+            else if (mode == "threaded")
+                vm.dispatch_mode = DISPATCH_THREADED;
+            else if (mode == "jit")
+                vm.dispatch_mode = DISPATCH_JIT;
+            else
+            {
+                std::cerr << "Error: Unknown dispatch mode '" << mode << "'" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "-s" && i + 1 < argc)
+        {
+            unsigned long size = std::strtoul(argv[++i], nullptr, 0);
+            if (size < 2 || size > vm.stack_top || size % 2 != 0)
+            {
+                std::cerr << "Error: Stack size must be even and between 2 and " << vm.stack_top << std::endl;
+                return 1;
+            }
+            vm.stack_size = size;
+        }
+        else if (arg == "-m" && i + 1 < argc)
+        {
+            if (!vm.set_banks(std::strtoul(argv[++i], nullptr, 0)))
+                return 1;
+        }
+        else if (arg == "-p" && i + 1 < argc)
+        {
+            profileFile = argv[++i];
+        }
+        else if (arg == "-t" && i + 1 < argc)
+        {
+            std::string clock = argv[++i];
+            if (clock == "real")
+                vm.wait_mode = WAIT_REALTIME;
+            else if (clock == "virtual")
+                vm.wait_mode = WAIT_VIRTUAL;
+            else
+            {
+                std::cerr << "Error: Unknown clock '" << clock << "'" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "-j" && i + 1 < argc)
+        {
+            threads = std::strtoul(argv[++i], nullptr, 0);
+            if (threads < 1)
+            {
+                std::cerr << "Error: Thread count must be at least 1" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "-n" && i + 1 < argc)
+        {
+            instances = std::strtoul(argv[++i], nullptr, 0);
+            if (instances < 1)
+            {
+                std::cerr << "Error: Instance count must be at least 1" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "-w")
+        {
+            watch = true;
+        }
+        else if (arg == "-O")
+        {
+            optimise = true;
+        }
+        else if (arg == "-a" && i + 1 < argc)
+        {
+            aotFile = argv[++i];
+        }
         else
         {
             outputFile = arg;
         }
     }
 
-    clearMemory();
-    TextAssembler assembler;
-
-    // Load and assemble the code
-    std::vector<std::string> code = assembler.loadFromFile(inputFile);
-    if (code.empty())
+    if (entry >= 0 && !binaryInput)
     {
-        std::cerr << "Error: No code to assemble" << std::endl;
+        std::cerr << "Error: -e sets the entry point of a -b image" << std::endl;
         return 1;
     }
 
-    std::cout << "Assembling " << inputFile << "..." << std::endl;
-    assembler.assemble(code);
-
-    // Determine start and end addresses
-    uint16_t start = 0x9000; // Default
-    uint16_t end = 0x9000;   // Will be updated
+    if (instances > 1 && (!profileFile.empty() || !aotFile.empty()))
+    {
+        std::cerr << "Error: " << (profileFile.empty() ? "-a" : "-p") << " cannot be used with -n" << std::endl;
+        return 1;
+    }
 
-    // Find the highest used memory address
-    for (uint16_t addr = start; addr < MEMORY_MAX; addr++)
+    if (watch)
     {
-        if (memory[addr] != 0)
+        if (binaryInput || hasSuffix(inputFile, ".hxo"))
         {
-            end = addr + 1;
+            std::cerr << "Error: -w watches assembly source" << std::endl;
+            return 1;
         }
+        if (optimise || !aotFile.empty() || instances > 1)
+        {
+            std::cerr << "Error: " << (optimise ? "-O" : !aotFile.empty() ? "-a" : "-n") << " cannot be used with -w" << std::endl;
+            return 1;
+        }
+        watchProgram(vm, inputFile, outputFile, runAfterAssembly);
     }
 
-    // Either save to file or print hex dump
-    if (!outputFile.empty())
+    std::unique_ptr<TextAssembler> assembler;
+    SymbolTable symbols;
+    std::vector<ObjectSection> sections; // what was loaded, for -a
+    if (hasSuffix(inputFile, ".hxo"))
     {
-        if (assembler.saveToFile(outputFile, start, end))
+        // Object files say where everything goes and carry their labels
+        if (!load_object(vm, inputFile, &symbols, &sections))
+            return 1;
+        std::cout << "Loaded " << inputFile << ", entry 0x" << std::hex << vm.cpu.pc << std::dec << std::endl;
+        runAfterAssembly = true;
+    }
+    else if (binaryInput)
+    {
+        // A prebuilt image goes straight into memory, with no parsing
+        if (!vm.load_image(inputFile, loadAddress))
+            return 1;
+        std::cout << "Loaded " << inputFile << " at 0x" << std::hex << loadAddress << std::dec << std::endl;
+        vm.instruction_base = entry < 0 ? loadAddress : entry;
+        vm.cpu.pc = vm.instruction_base;
+        runAfterAssembly = true;
+
+        // All of an image may be code
+        struct stat st;
+        if (stat(inputFile.c_str(), &st) == 0)
+            sections.push_back(ObjectSection{loadAddress, SECTION_CODE,
+                                             (uint32_t)std::min<off_t>(st.st_size, 0x10000 - loadAddress)});
+    }
+    else
+    {
+        vm.clearMemory();
+        assembler.reset(new TextAssembler(vm.memory));
+
+        // Load and assemble the code
+        SourceFile source;
+        if (!source.open(inputFile))
         {
-            std::cout << "Binary output saved to " << outputFile << std::endl;
-            std::cout << "Size: " << (end - start) << " bytes" << std::endl;
+            return 1;
+        }
+        if (source.text().empty())
+        {
+            std::cerr << "Error: No code to assemble" << std::endl;
+            return 1;
+        }
+
+        std::cout << "Assembling " << inputFile << "..." << std::endl;
+        assembler->setOptimise(optimise);
+        assembler->assemble(source.text(), threads);
+        if (optimise)
+        {
+            const PeepholeStats &saved = assembler->optimised();
+            std::cout << "Peephole: removed " << saved.instructions << " instructions, "
+                      << saved.bytes << " bytes" << std::endl;
+            for (const auto &rule : saved.rules)
+                std::cout << "  " << rule.first << ": " << rule.second << std::endl;
+            ControlFlowGraph graph;
+            graph.build(vm.memory, assembler->sections(), assembler->entry(), &assembler->symbols());
+            std::cout << "Control flow: " << graph.blocks().size() << " basic blocks, "
+                      << graph.unreachable_bytes() << " bytes unreachable" << std::endl;
         }
+        vm.instruction_base = assembler->entry();
+        vm.cpu.pc = vm.instruction_base;
+        sections = assembler->sections();
+
+        saveOutput(*assembler, outputFile);
     }
-    else
+
+    // Translate instead of running
+    if (!aotFile.empty())
     {
-        std::cout << "Assembly result:" << std::endl;
-        assembler.hexDump(start, end);
+        if (!write_aot(aotFile, vm, sections))
+            return 1;
+        std::cout << "Translated program written to " << aotFile << std::endl;
+        return 0;
     }
 
     // Run the program if requested
-    if (runAfterAssembly)
+    if (runAfterAssembly && instances > 1)
+    {
+        std::cout << "\n===================================\n";
+        if (!runInstances(vm, sections, instances))
+            return 1;
+    }
+    else if (runAfterAssembly)
     {
         std::cout << "\n===================================\n";
-        runProgram();
+        std::unique_ptr<Profile> profile;
+        if (!profileFile.empty())
+        {
+            profile.reset(new Profile(vm.cpu.pc));
+            vm.profile = profile.get();
+        }
+
+        runProgram(vm);
+
+        if (profile)
+        {
+            // Loaded programs only have the labels their file carried
+            if (!assembler)
+            {
+                assembler.reset(new TextAssembler(vm.memory));
+                for (const auto &symbol : symbols)
+                    assembler->defineSymbol(symbol.first, symbol.second);
+            }
+            std::ofstream report(profileFile);
+            std::ofstream folded(profileFile + ".folded");
+            profile->write_report(report, *assembler);
+            profile->write_folded(folded, *assembler);
+            if (report && folded)
+                std::cout << "Profile written to " << profileFile << " and " << profileFile << ".folded" << std::endl;
+            else
+                std::cerr << "Error: Could not write profile to " << profileFile << std::endl;
+        }
     }
 
     return 0;
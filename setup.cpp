@@ -1,6 +0,0 @@
-// filepath: /home/utkarsh/Desktop/vm/setup.cpp
-#include "setup.h"
-
-// Define the global variables declared in setup.h
-uint8_t memory[MEMORY_MAX] = {0};
-uint16_t instruction_base = 0x9000; // Start of instructions in memory
@@ -2,13 +2,16 @@
 #define SETUP_H
 
 #include <cstdint>
-#include <stack>
-#define MEMORY_MAX 0xffff // in bytes
+#define MEMORY_MAX 0xffff     // in bytes
+#define ADDRESS_SPACE 0x10000 // bytes the guest can address, 0x0000-0xFFFF
+#define BANK_WINDOW 0x4000    // the window banks are switched into...
+#define BANK_SIZE 0x4000      // ...and its size, 16 KB
+#define BANK_MAX 0x10000      // most banks a VM can be given (1 GB)
+#define VECTOR_REGS 4         // v0-v3
+#define VECTOR_LANES 8        // 16-bit lanes per vector register
 #define uc unsigned char
 #define int8 uint8_t
 
-extern uint8_t memory[MEMORY_MAX];
-
 enum opcodes : uint8_t
 {
     // ───────────────────────
@@ -48,6 +51,18 @@ enum opcodes : uint8_t
     LOAD8_A_MEM = 0x22,  // A = zero-extended memory[addr] (8-bit)
     STORE8_A_MEM = 0x23, // memory[addr] = A & 0xFF (8-bit)
 
+    // ───────────────────────
+    // Block Memory (C bytes; ranges wrap at 0xFFFF)
+    // ───────────────────────
+    MEMCPY = 0x28, // memory[A..] = memory[B..], as if through a copy
+    MEMSET = 0x29, // memory[A..] = B & 0xFF
+    MEMCMP = 0x2A, // Compare memory[A..] with memory[B..] (set flags)
+
+    // ───────────────────────
+    // Memory Banks
+    // ───────────────────────
+    BANK = 0x2B, // Map bank A into 0x4000-0x7FFF
+
     // ───────────────────────
     // Generic 2-Operand Format
     // ───────────────────────
@@ -93,6 +108,23 @@ enum opcodes : uint8_t
     SHL = 0x64, // A = A << 1
     SHR = 0x65, // A = A >> 1
 
+    // ───────────────────────
+    // Vector (v0-v3, 8 x 16-bit lanes)
+    // ───────────────────────
+    VLOAD = 0x80,  // v = 8 words at memory[B] (little-endian)
+    VSTORE = 0x81, // 8 words at memory[B] = v
+    VSPLAT = 0x82, // every lane of v = A
+    VADD = 0x83,   // v1 += v2, lane by lane
+    VSUB = 0x84,   // v1 -= v2
+    VAND = 0x85,   // v1 &= v2
+    VOR = 0x86,    // v1 |= v2
+    VXOR = 0x87,   // v1 ^= v2
+    VCMPEQ = 0x88, // lane of v1 = 0xFFFF if v1 == v2, else 0
+    VCMPGT = 0x89, // lane of v1 = 0xFFFF if v1 > v2 (unsigned), else 0
+    VSUM = 0x8A,   // A = sum of the lanes of v
+    VMIN = 0x8B,   // A = smallest lane of v
+    VMAX = 0x8C,   // A = largest lane of v
+
     // ───────────────────────
     // Timer / Delays
     // ───────────────────────
@@ -107,11 +139,9 @@ enum opcodes : uint8_t
     HALT = 0xFF     // True HALT
 };
 
-extern uint16_t instruction_base;
-
 struct CPU
 {
-    uint16_t pc = instruction_base; // Program Counter
+    uint16_t pc = 0x9000; // Program Counter
     uint16_t a = 0;                 // Accumulator
     uint16_t b = 0;                 // General Purpose Register
     uint16_t c = 0;
@@ -119,17 +149,17 @@ struct CPU
     uint8_t flag = 0;           // Status Flags
     uint8_t zero_flag = 0,
             negative_flag = 0;
-    std::stack<uint16_t> stack;
-    void reset()
+    uint16_t sp = 0; // Stack Pointer, see VM::push()
+    alignas(16) uint16_t v[VECTOR_REGS][VECTOR_LANES] = {}; // vector registers, kept by reset() like C
+    void reset(uint16_t instruction_base, uint16_t stack_top)
     {
         pc = instruction_base;
+        sp = stack_top;
         a = 0;
         b = 0;
         flag = 0;
         zero_flag = 0;
         negative_flag = 0;
-        while (!stack.empty())
-            stack.pop();
     }
 };
 